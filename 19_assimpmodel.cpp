@@ -1,11 +1,44 @@
 #include <cmath>
+#include <cfloat>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 
 #include <vector>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <iostream>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/stat.h>
+
+#if defined(__SSE__) || defined(_M_X64)
+    #include <xmmintrin.h>
+#endif
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+#endif
+
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
@@ -27,44 +60,153 @@
 #define SIZE_WIDTH 1920
 #define SIZE_HEIGHT 1080
 
-#define MAX_POINT_LIGHT 2
+// #define RANDOM_LIGHTS
+#define POINT_LIGHT_COUNT 512
+#define PARALLEL_LIGHT_COUNT 64
+// far enough past the far plane that the cluster falloff window leaves the authored attenuation alone
+#define AUTHORED_LIGHT_RADIUS (10.0f * CAMERA_FAR)
+
+#define CAMERA_FOV 45.0f
+#define CAMERA_ASPECT 1.78f
+#define CAMERA_NEAR 0.1f
+#define CAMERA_FAR 1000.f
+
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+
+// #define PACKED_VERTEX
 
-#define VERTEX_SHADER "../shader/vtx_specular_shader.vert"
-#define FRAGMENT_SHADER "../shader/frag_point_shader.frag"
+#define SHADER_DIR "../shader/"
+#define SCENE_VERTEX_SHADER "../shader/vtx_scene_shader.vert"
+#define SCENE_FRAGMENT_SHADER "../shader/frag_scene_shader.frag"
+#define LIGHTING_VERTEX_SHADER "../shader/vtx_fullscreen_shader.vert"
+#define LIGHTING_FRAGMENT_SHADER "../shader/frag_deferred_shader.frag"
+#define FALLBACK_FRAGMENT_SHADER "../shader/frag_fallback_shader.frag"
+#define DEPTH_FRAGMENT_SHADER "../shader/frag_depth_shader.frag"
 
 #define LOAD_TEXTURE
+#define MESH_CACHE
+#define PROGRAM_CACHE
+#define ASYNC_SHADER_COMPILE
+#define SHADER_HOT_RELOAD
+#define PARALLEL_IMPORT
+// #define IMPORT_BENCHMARK
+#define WELD_VERTICES
+#define OPTIMIZE_MESHES
+#define SHORT_INDICES
+#define SCENE_BUFFER
+#define SORT_DRAW_LIST
+#define DRAW_SORT_MODE SORT_STATE_DEPTH
+#define FRUSTUM_CULLING
+#define BVH_CULLING
+// #define BVH_BENCHMARK
 
-#define glfwMainLoop(w) while (!glfwWindowShouldClose(w)) render(w)
+#define WELD_EPSILON 0.0f
+
+#define VERTEX_CACHE_SIZE 32
+#define SIMULATED_CACHE_SIZE 16
+
+#define MAX_SHORT_INDEX_VERTICES 65536
+
+#define BVH_BIN_COUNT 16
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 64
 
+#define SORT_MOVE_BUDGET 8
 
-GLuint g_model;
-GLuint g_view;
-GLuint g_projection;
-GLuint g_sampler;
+#define SHADER_POLL_INTERVAL 0.5f
 
-struct {
-    GLuint color;
-    GLuint direction;
-    GLuint intensity;
-} g_parallel_light;
+#define DEFAULT_TEXTURE_SIZE 4
+#define DEFAULT_TEXTURE_COLOR 128
 
-struct {
-    GLuint color;
-    GLuint position;
+#define MESH_CACHE_MAGIC "LGMC"
+#define MESH_CACHE_VERSION 7
+#define MESH_CACHE_SUFFIX ".meshcache"
 
-    GLuint constant;
-    GLuint linear;
-    GLuint quadratic;
-} g_point_light_list[MAX_POINT_LIGHT];
+#define PROGRAM_CACHE_MAGIC "LGPC"
+#define PROGRAM_CACHE_VERSION 1
+#define PROGRAM_CACHE_DIR "../shader/cache/"
+#define PROGRAM_CACHE_SUFFIX ".programcache"
+
+#define IMPORT_FLAG_WELD 0x1
+#define IMPORT_FLAG_OPTIMIZE 0x2
+#define IMPORT_FLAG_SHORT_INDICES 0x4
+
+#define FRAME_BLOCK_BINDING 0
+#define LIGHT_BLOCK_BINDING 1
+
+#define LIGHT_LIST_BINDING 0
+#define CLUSTER_GRID_BINDING 1
+#define CLUSTER_INDEX_BINDING 2
+
+#define GBUFFER_ALBEDO_UNIT 0
+#define GBUFFER_NORMAL_UNIT 1
+#define GBUFFER_DEPTH_UNIT 2
+
+#define INVERSE_VIEW_PROJECTION_LOCATION 0
+#define QUANT_OFFSET_LOCATION 0
+#define QUANT_SCALE_LOCATION 1
+#define SAMPLER_LOCATION 2
+
+// #define LIGHT_BENCHMARK
+
+#define glfwMainLoop(w) while (!glfwWindowShouldClose(w)) render(w)
 
-GLuint g_point_light_num;
-GLuint g_camera_pos;
-GLuint g_specular;
 
 float specular = 1.0f;
 float this_time, last_time, remain_time, time_count;
 int frame_count;
 
+float submit_time;
+int draw_call_count;
+int state_change_count;
+int state_change_avoided;
+
+float cull_time;
+int visible_count;
+int culled_count;
+
+float light_assign_time;
+
+float program_submit_time;
+float program_link_time;
+int program_count;
+int program_cache_hits;
+bool parallel_shader_compile = false;
+bool light_clustering = true;
+bool deferred_shading = false;
+int active_light_count = POINT_LIGHT_COUNT;
+
+bool depth_prepass = false;
+float prepass_gpu_time;
+float shade_gpu_time;
+double shaded_samples;
+
+enum render_mode {
+    RENDER_BATCHED,
+    RENDER_INDIRECT,
+    RENDER_MODE_COUNT
+};
+
+const char* render_mode_names[RENDER_MODE_COUNT] = {"batched", "indirect"};
+
+render_mode current_render_mode = RENDER_BATCHED;
+
+// SORT_STATE keeps the state order only, SORT_DEPTH draws nearest meshes first and breaks ties by state,
+// SORT_STATE_DEPTH keeps the state order and draws front-to-back inside each state
+enum draw_sort_mode {
+    SORT_STATE,
+    SORT_DEPTH,
+    SORT_STATE_DEPTH,
+    SORT_MODE_COUNT
+};
+
+const char* sort_mode_names[SORT_MODE_COUNT] = {"state", "depth", "state+depth"};
+
+draw_sort_mode current_sort_mode = DRAW_SORT_MODE;
+float sort_time;
+
 GLfloat pitch = 0.f, yaw = 0.f;
 
 struct camera {
@@ -96,437 +238,4330 @@ struct vertex {
 };
 
 
-class texture {
+struct packed_vertex {
+    int16_t position[4];
+    uint16_t texcoord[2];
+    int16_t normal[2];
+};
 
-public:
-    GLuint TEX;
-    GLuint sampler;
 
-    const char* image_path;
-    unsigned char* content;
+struct packing_error {
+    float position;
+    float texcoord;
+    float normal_degrees;
+    size_t vertex_count;
 
-    texture() {}
+    packing_error() : position(0), texcoord(0), normal_degrees(0), vertex_count(0) {}
+};
 
-    texture(const char* path, GLuint spl) {
-            image_path = path;
-            sampler = spl;
-            loaded = true;
-            load_image();
-    }
 
-    ~texture() {}
+packing_error packing_stats;
 
-    void load_default_color()
-    {
-        width = 1024;
-        height = 1024;
-        channels = 3;
-        content = (unsigned char*) malloc(sizeof(unsigned char) * width * height * channels);
-        memset(content, 128, width * height * channels);
 
-        create_texture_buffer();
-    }  
+struct bounding_volume {
+    glm::vec3 aabb_min;
+    glm::vec3 aabb_max;
+    glm::vec3 center;
+    float radius;
 
-private:
-    int width;
-    int height;
-    int channels;
+    bounding_volume() : aabb_min(0.f), aabb_max(0.f), center(0.f), radius(0) {}
+};
 
-    bool loaded;
 
-    void load_image()
-    {
-        content = stbi_load(image_path, & width, & height, & channels, 0);
+struct frustum {
+    glm::vec4 planes[6];
+};
 
-        if (!content) {
-            std::cerr << "[WARNING] can not load image: " << image_path << std::endl;
-            load_default_color();
-            loaded = false;
-        }
-        create_texture_buffer();
-    } 
 
-    GLenum get_image_format_type(int channels)
-    {
-        switch (channels)
-        {
-            case 1: return GL_RED;
-            case 3: return GL_RGB;
-            case 4: return GL_RGBA;
-            default: return GL_RGB;
-        }
+struct mesh_data {
+    std::vector<vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::string texture_path;
+    bounding_volume bounds;
+    int source_mesh;
+
+    float acmr;
+    float atvr;
+
+    mesh_data() : source_mesh(0), acmr(0), atvr(0) {}
+};
+
+
+struct mesh_instance {
+    int mesh_index;
+    glm::mat4 transform;
+    bounding_volume bounds;
+};
+
+
+struct mesh_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t vertex_size;
+    uint32_t mesh_count;
+    uint32_t instance_count;
+    uint32_t import_flags;
+    float weld_epsilon;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+};
+
+
+struct program_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t binary_format;
+    uint32_t binary_size;
+    uint64_t program_key;
+};
+
+
+struct mesh_cache_entry {
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t path_length;
+    uint32_t index_type;
+    float acmr;
+    float atvr;
+    float aabb_min[3];
+    float aabb_max[3];
+    float center[3];
+    float radius;
+};
+
+
+struct mesh_cache_instance {
+    uint32_t mesh_index;
+    float transform[16];
+};
+
+
+uint64_t fnv1a_hash(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
     }
+    return hash;
+}
 
-    void create_texture_buffer()
-    {
-        GLenum format = get_image_format_type(channels);
 
-        glUniform1i(sampler, 0);
-        glGenTextures(1, & TEX);
-        glBindTexture(GL_TEXTURE_2D, TEX);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, content);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        set_texture_parameter();
+struct memory_counter {
+    std::atomic<size_t> cpu_bytes;
+    std::atomic<size_t> cpu_peak_bytes;
+    size_t gpu_buffer_bytes;
+    size_t gpu_texture_bytes;
+
+    memory_counter() : cpu_bytes(0), cpu_peak_bytes(0), gpu_buffer_bytes(0), gpu_texture_bytes(0) {}
+
+    void allocate_cpu(size_t bytes)
+    {
+        size_t current = cpu_bytes += bytes;
+        size_t peak = cpu_peak_bytes;
+        while (current > peak && !cpu_peak_bytes.compare_exchange_weak(peak, current)) {}
     }
 
-    void set_texture_parameter()
+    void release_cpu(size_t bytes) { cpu_bytes -= bytes; }
+
+    void report(const std::string& label)
     {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        std::cout << "[INFO] " << label << " memory: cpu " << cpu_bytes / 1024 << " KB "
+            << "(peak " << cpu_peak_bytes / 1024 << " KB), "
+            << "gpu buffers " << gpu_buffer_bytes / 1024 << " KB, "
+            << "gpu textures " << gpu_texture_bytes / 1024 << " KB" << std::endl;
     }
 };
 
 
-class mesh {
+memory_counter memory_stats;
 
-public:
 
-    GLuint VAO;
-    GLuint TEX;
-    GLuint index_size;
+// workers are started on first use and then sleep between jobs, the calling thread takes part in every job
+class thread_pool {
 
-    mesh() {}
+public:
 
-    mesh(std::vector<vertex>& vertices, std::vector<unsigned int>& indices, GLuint tex_id) 
-    {
-        create_vertex_array();
-        create_vertex_buffer(vertices);
-        create_index_buffer(indices);
-        TEX = tex_id;
-    }
+    thread_pool() : job(NULL), job_count(0), participants(0), active(0), generation(0), stopping(false) {}
 
-    void create_vertex_array()
+    ~thread_pool()
     {
-        glGenVertexArrays(1, & VAO);
-        glBindVertexArray(VAO);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (int t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
     }
 
-    void create_vertex_buffer(std::vector<vertex>& vertices)
+    // a job submitted from inside another job, or from a second thread, runs on the calling thread
+    void run(int count, int thread_count, const std::function<void(int)>& func)
     {
-        int buffer_size = sizeof(vertex) * vertices.size();
-        GLuint VBO;
-        glGenBuffers(1, & VBO);
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, buffer_size, &vertices[0], GL_STATIC_DRAW);
+        std::unique_lock<std::mutex> busy;
+        if (!in_job) {
+            busy = std::unique_lock<std::mutex>(run_mutex, std::try_to_lock);
+        }
+        if (!busy.owns_lock()) {
+            for (int i = 0; i < count; i++) {
+                func(i);
+            }
+            return;
+        }
 
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
-        glEnableVertexAttribArray(2);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (workers.size() < std::min(thread_count, count) - 1) {
+                workers.push_back(std::thread(& thread_pool::worker_loop, this, (int) workers.size(), generation));
+            }
+            job = & func;
+            job_count = count;
+            next = 0;
+            participants = std::min(thread_count, count) - 1;
+            active = participants;
+            generation++;
+        }
+        wake.notify_all();
+        drain();
 
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), 0);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (const GLvoid*) 12);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (const GLvoid*) 20);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return active == 0; });
+        job = NULL;
     }
 
-    void create_index_buffer(std::vector<unsigned int>& indices)
+private:
+    std::vector<std::thread> workers;
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int)>* job;
+    int job_count;
+    std::atomic<int> next;
+    int participants;
+    int active;
+    uint64_t generation;
+    bool stopping;
+
+    static thread_local bool in_job;
+
+    void drain()
     {
-        index_size = indices.size();
-        int buffer_size = sizeof(unsigned int) * index_size;
-        GLuint IBO;
-        glGenBuffers(1, & IBO);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, buffer_size, &indices[0], GL_STATIC_DRAW);
+        in_job = true;
+        for (int i = next++; i < job_count; i = next++) {
+            (* job)(i);
+        }
+        in_job = false;
+    }
 
+    void worker_loop(int index, uint64_t seen)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            if (index >= participants) {
+                continue;
+            }
+            lock.unlock();
+            drain();
+            lock.lock();
+            if (--active == 0) {
+                done.notify_one();
+            }
+        }
     }
 };
 
 
-class scene {
+thread_local bool thread_pool::in_job = false;
 
-public:
-    std::string scene_path;
-    std::string scene_dir;
+thread_pool worker_pool;
 
-    std::vector<mesh> scene_meshes;
-    
-    texture default_texture;
 
-    scene() {}
+void parallel_for(int count, int thread_count, const std::function<void(int)>& func)
+{
+    if (thread_count <= 1 || count <= 1) {
+        for (int i = 0; i < count; i++) {
+            func(i);
+        }
+        return;
+    }
+    worker_pool.run(count, thread_count, func);
+}
 
-    scene(std::string path)
-    {
-        scene_path = path;
-        scene_dir = get_scene_dir();
-        default_texture.load_default_color();
 
-        load_scene();
+int get_import_thread_count()
+{
+    #ifdef PARALLEL_IMPORT
+        int count = std::thread::hardware_concurrency();
+        return count > 0 ? count : 1;
+    #else
+        return 1;
+    #endif
+}
+
+
+struct vertex_key {
+    int32_t values[8];
+
+    bool operator == (const vertex_key& other) const
+    {
+        return memcmp(values, other.values, sizeof(values)) == 0;
     }
+};
 
 
-    std::string get_scene_dir()
+struct vertex_key_hash {
+    size_t operator () (const vertex_key& key) const
     {
-        std::string::size_type slash_index = scene_path.find_last_of("/\\");
-        std::string scene_dir;
+        return fnv1a_hash(key.values, sizeof(key.values));
+    }
+};
 
-        if (slash_index == std::string::npos) {
-            scene_dir = ".";
-        }
-        else if (slash_index == 0) {
-            scene_dir = "/";
+
+vertex_key get_vertex_key(const vertex& vtx, float epsilon)
+{
+    float fields[8] = {
+        vtx.position.x, vtx.position.y, vtx.position.z,
+        vtx.texcoord.x, vtx.texcoord.y,
+        vtx.normal.x, vtx.normal.y, vtx.normal.z
+    };
+
+    vertex_key key;
+    for (int i = 0; i < 8; i++) {
+        if (epsilon > 0) {
+            key.values[i] = (int32_t) floor(fields[i] / epsilon + 0.5f);
         }
         else {
-            scene_dir = scene_path.substr(0, slash_index);
+            float value = fields[i] + 0.0f;
+            memcpy(& key.values[i], & value, sizeof(float));
         }
-        return scene_dir;
     }
+    return key;
+}
 
-    void load_scene()
-    {
-        Assimp::Importer importer;
 
-        const aiScene* scene_ptr = importer.ReadFile(
-            scene_path.c_str(), 
-            aiProcess_Triangulate |
-            aiProcess_GenSmoothNormals | 
-            aiProcess_FlipUVs
-        );
+void weld_vertices(std::vector<vertex>& vertices, std::vector<unsigned int>& indices, float epsilon)
+{
+    if (vertices.empty() || indices.empty()) {
+        return;
+    }
 
-        if (!scene_ptr) {
-            std::cerr << "[ERROR] load scene failed:" << scene_path << std::endl;
-            std::cerr << importer.GetErrorString();
-            exit(1);
+    std::unordered_map<vertex_key, unsigned int, vertex_key_hash> lookup;
+    lookup.reserve(vertices.size());
+
+    std::vector<unsigned int> remap(vertices.size());
+    std::vector<vertex> welded;
+    welded.reserve(vertices.size());
+
+    for (int i = 0; i < vertices.size(); i++) {
+        vertex_key key = get_vertex_key(vertices[i], epsilon);
+        std::pair<std::unordered_map<vertex_key, unsigned int, vertex_key_hash>::iterator, bool> found =
+            lookup.insert(std::make_pair(key, (unsigned int) welded.size()));
+        if (found.second) {
+            welded.push_back(vertices[i]);
         }
+        remap[i] = found.first->second;
+    }
 
-        init_scene(scene_ptr);
+    for (int i = 0; i < indices.size(); i++) {
+        indices[i] = remap[indices[i]];
     }
+    welded.shrink_to_fit();
+    vertices.swap(welded);
+}
 
-    void init_scene(const aiScene* scn)
-    {
-        for (int i = 0; i < scn->mNumMeshes; i++) {
-            aiMesh* msh = scn->mMeshes[i];
-            scene_meshes.push_back(init_mesh(scn, msh));
+
+void analyze_vertex_cache(const std::vector<unsigned int>& indices, size_t vertex_count, float& acmr, float& atvr)
+{
+    std::vector<unsigned int> timestamps(vertex_count, 0);
+    unsigned int time = SIMULATED_CACHE_SIZE + 1;
+    size_t misses = 0;
+
+    for (int i = 0; i < indices.size(); i++) {
+        unsigned int index = indices[i];
+        if (time - timestamps[index] > SIMULATED_CACHE_SIZE) {
+            timestamps[index] = time++;
+            misses++;
         }
     }
 
-    mesh init_mesh(const aiScene* scn, aiMesh* msh)
-    {
-        std::vector<vertex> vertices;
-        aiVector3D default_uv(0., 0., 0.);
-        for (int i = 0; i < msh->mNumVertices; i++) {
-            aiVector3D position = msh->mVertices[i];
-            aiVector3D normal = msh->mNormals[i];
-            aiVector3D uv = msh->HasTextureCoords(0) ? msh->mTextureCoords[0][i] : default_uv;
+    acmr = indices.size() ? (float) misses / (indices.size() / 3) : 0;
+    atvr = vertex_count ? (float) misses / vertex_count : 0;
+}
 
-            vertex vtx(
-                glm::vec3(position.x, position.y, position.z),
-                glm::vec2(uv.x, uv.y),
-                glm::vec3(normal.x, normal.y, normal.z)
-            );
-            vertices.push_back(vtx);
-        }
-        std::vector<unsigned int> indices = init_indices(msh);
 
-        #ifdef LOAD_TEXTURE
-            texture tex = init_material(scn, msh);
-        #else
-            texture tex = default_texture;
-        #endif
-    
-        return mesh(vertices, indices, tex.TEX);
+float get_forsyth_vertex_score(int cache_position, int remaining_valence)
+{
+    if (remaining_valence == 0) {
+        return -1.0f;
     }
 
-    std::vector<unsigned int> init_indices(aiMesh* mesh)
-    {
-        std::vector<unsigned int> indices;
-        for (int i = 0; i < mesh->mNumFaces; i++) {
-            aiFace face = mesh->mFaces[i];
-            for (int j = 0; j < face.mNumIndices; j++) {
-                indices.push_back(face.mIndices[j]);
-            }
-        }
-
-        return indices;
+    float score = 0.0f;
+    if (cache_position >= 0 && cache_position < 3) {
+        score = 0.75f;
     }
+    else if (cache_position >= 3) {
+        score = pow(1.0f - (cache_position - 3) / (float) (VERTEX_CACHE_SIZE - 3), 1.5f);
+    }
+    return score + 2.0f * pow((float) remaining_valence, -0.5f);
+}
 
-    texture init_material(const aiScene* scn, aiMesh* msh)
-    {
-        texture tex = texture();
-        const aiMaterial* mat = scn->mMaterials[msh->mMaterialIndex];
-        if (mat->GetTextureCount(aiTextureType_DIFFUSE) > 0) {
-            aiString path;
-            mat->GetTexture(aiTextureType_DIFFUSE, 0, &path);
-            std::string abs_path = scene_dir + "/" + path.data;
-            std::cout << abs_path << std::endl;
-            tex = texture(abs_path.c_str(), g_sampler);
-        }
-        return tex;
+
+void optimize_vertex_cache(std::vector<unsigned int>& indices, size_t vertex_count)
+{
+    if (vertex_count == 0 || indices.empty()) {
+        return;
     }
-};
 
+    size_t triangle_count = indices.size() / 3;
 
-scene base_scene;
+    std::vector<unsigned int> offsets(vertex_count + 1, 0);
+    for (int i = 0; i < indices.size(); i++) {
+        offsets[indices[i] + 1]++;
+    }
+    for (int i = 0; i < vertex_count; i++) {
+        offsets[i + 1] += offsets[i];
+    }
 
+    std::vector<int> remaining(vertex_count, 0);
+    std::vector<unsigned int> adjacency(indices.size());
+    for (int i = 0; i < indices.size(); i++) {
+        unsigned int index = indices[i];
+        adjacency[offsets[index] + remaining[index]++] = i / 3;
+    }
 
-class shader {
+    std::vector<int> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (int i = 0; i < vertex_count; i++) {
+        vertex_score[i] = get_forsyth_vertex_score(-1, remaining[i]);
+    }
 
-public:
+    std::vector<float> triangle_score(triangle_count);
+    std::vector<bool> emitted(triangle_count, false);
+    int best_triangle = -1;
+    float best_score = -1.0f;
+    for (int i = 0; i < triangle_count; i++) {
+        triangle_score[i] = vertex_score[indices[i * 3]] + vertex_score[indices[i * 3 + 1]] + vertex_score[indices[i * 3 + 2]];
+        if (triangle_score[i] > best_score) {
+            best_score = triangle_score[i];
+            best_triangle = i;
+        }
+    }
 
-    GLuint program;
+    std::vector<unsigned int> output;
+    output.reserve(indices.size());
+    std::vector<unsigned int> cache, next_cache;
+    size_t cursor = 0;
 
-    shader() {}
-    
-    shader(std::string vtx_path, std::string frag_path) {
+    for (int k = 0; k < triangle_count; k++) {
+        if (best_triangle < 0) {
+            while (emitted[cursor]) {
+                cursor++;
+            }
+            best_triangle = cursor;
+        }
+
+        const unsigned int* triangle = &indices[best_triangle * 3];
+        emitted[best_triangle] = true;
+        next_cache.clear();
+
+        for (int j = 0; j < 3; j++) {
+            unsigned int index = triangle[j];
+            output.push_back(index);
+            next_cache.push_back(index);
+
+            unsigned int* list = &adjacency[offsets[index]];
+            for (int t = 0; t < remaining[index]; t++) {
+                if (list[t] == best_triangle) {
+                    list[t] = list[remaining[index] - 1];
+                    remaining[index]--;
+                    break;
+                }
+            }
+        }
+
+        for (int i = 0; i < cache.size(); i++) {
+            unsigned int index = cache[i];
+            if (index != triangle[0] && index != triangle[1] && index != triangle[2]) {
+                next_cache.push_back(index);
+            }
+        }
+        cache.swap(next_cache);
+
+        for (int i = VERTEX_CACHE_SIZE; i < cache.size(); i++) {
+            cache_position[cache[i]] = -1;
+            vertex_score[cache[i]] = get_forsyth_vertex_score(-1, remaining[cache[i]]);
+        }
+        if (cache.size() > VERTEX_CACHE_SIZE) {
+            cache.resize(VERTEX_CACHE_SIZE);
+        }
+
+        for (int i = 0; i < cache.size(); i++) {
+            cache_position[cache[i]] = i;
+            vertex_score[cache[i]] = get_forsyth_vertex_score(i, remaining[cache[i]]);
+        }
+
+        best_triangle = -1;
+        best_score = -1.0f;
+        for (int i = 0; i < cache.size(); i++) {
+            unsigned int index = cache[i];
+            for (int t = 0; t < remaining[index]; t++) {
+                unsigned int tri = adjacency[offsets[index] + t];
+                float score = vertex_score[indices[tri * 3]] + vertex_score[indices[tri * 3 + 1]] + vertex_score[indices[tri * 3 + 2]];
+                triangle_score[tri] = score;
+                if (score > best_score) {
+                    best_score = score;
+                    best_triangle = tri;
+                }
+            }
+        }
+    }
+
+    indices.swap(output);
+}
+
+
+void optimize_overdraw(std::vector<unsigned int>& indices, const std::vector<vertex>& vertices)
+{
+    size_t triangle_count = indices.size() / 3;
+    if (vertices.empty() || triangle_count == 0) {
+        return;
+    }
+
+    std::vector<unsigned int> cluster_starts;
+    std::vector<unsigned int> timestamps(vertices.size(), 0);
+    unsigned int time = SIMULATED_CACHE_SIZE + 1;
+    for (int i = 0; i < triangle_count; i++) {
+        int misses = 0;
+        for (int j = 0; j < 3; j++) {
+            unsigned int index = indices[i * 3 + j];
+            if (time - timestamps[index] > SIMULATED_CACHE_SIZE) {
+                timestamps[index] = time++;
+                misses++;
+            }
+        }
+        if (i == 0 || misses == 3) {
+            cluster_starts.push_back(i);
+        }
+    }
+    cluster_starts.push_back(triangle_count);
+
+    glm::vec3 mesh_center(0.f);
+    for (int i = 0; i < vertices.size(); i++) {
+        mesh_center += vertices[i].position;
+    }
+    mesh_center = mesh_center / (float) vertices.size();
+
+    size_t cluster_count = cluster_starts.size() - 1;
+    std::vector<std::pair<float, unsigned int> > cluster_keys(cluster_count);
+    for (int c = 0; c < cluster_count; c++) {
+        glm::vec3 center(0.f), normal(0.f);
+        float area = 0.f;
+        for (int i = cluster_starts[c]; i < cluster_starts[c + 1]; i++) {
+            glm::vec3 a = vertices[indices[i * 3]].position;
+            glm::vec3 b = vertices[indices[i * 3 + 1]].position;
+            glm::vec3 d = vertices[indices[i * 3 + 2]].position;
+            glm::vec3 face_normal = glm::cross(b - a, d - a);
+            float face_area = glm::length(face_normal);
+            center += (a + b + d) * (face_area / 3.f);
+            normal += face_normal;
+            area += face_area;
+        }
+        center = area > 0 ? center / area : vertices[indices[cluster_starts[c] * 3]].position;
+        float normal_length = glm::length(normal);
+        float key = normal_length > 0 ? glm::dot(center - mesh_center, normal / normal_length) : 0.f;
+        cluster_keys[c] = std::make_pair(-key, (unsigned int) c);
+    }
+    std::stable_sort(cluster_keys.begin(), cluster_keys.end());
+
+    std::vector<unsigned int> output;
+    output.reserve(indices.size());
+    for (int k = 0; k < cluster_count; k++) {
+        unsigned int c = cluster_keys[k].second;
+        output.insert(output.end(), indices.begin() + cluster_starts[c] * 3, indices.begin() + cluster_starts[c + 1] * 3);
+    }
+    indices.swap(output);
+}
+
+
+void optimize_vertex_fetch(std::vector<vertex>& vertices, std::vector<unsigned int>& indices)
+{
+    if (vertices.empty() || indices.empty()) {
+        return;
+    }
+
+    std::vector<unsigned int> remap(vertices.size(), 0xFFFFFFFF);
+    std::vector<vertex> reordered;
+    reordered.reserve(vertices.size());
+
+    for (int i = 0; i < indices.size(); i++) {
+        unsigned int& index = indices[i];
+        if (remap[index] == 0xFFFFFFFF) {
+            remap[index] = reordered.size();
+            reordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    vertices.swap(reordered);
+}
+
+
+std::vector<mesh_data> split_mesh_data(const mesh_data& data, size_t max_vertices)
+{
+    std::vector<mesh_data> chunks;
+    if (data.vertices.empty() || data.indices.empty()) {
+        return chunks;
+    }
+
+    std::vector<unsigned int> remap(data.vertices.size());
+    std::vector<int> owner(data.vertices.size(), -1);
+
+    for (int t = 0; t < data.indices.size() / 3; t++) {
+        const unsigned int* triangle = &data.indices[t * 3];
+        int chunk_id = chunks.size() - 1;
+        int new_vertices = 0;
+        for (int j = 0; j < 3; j++) {
+            if (owner[triangle[j]] != chunk_id) {
+                new_vertices++;
+            }
+        }
+        if (chunks.empty() || chunks.back().vertices.size() + new_vertices > max_vertices) {
+            chunks.push_back(mesh_data());
+            chunks.back().texture_path = data.texture_path;
+            chunks.back().source_mesh = data.source_mesh;
+            chunks.back().acmr = data.acmr;
+            chunks.back().atvr = data.atvr;
+            chunk_id++;
+        }
+
+        mesh_data& chunk = chunks.back();
+        for (int j = 0; j < 3; j++) {
+            unsigned int index = triangle[j];
+            if (owner[index] != chunk_id) {
+                owner[index] = chunk_id;
+                remap[index] = chunk.vertices.size();
+                chunk.vertices.push_back(data.vertices[index]);
+            }
+            chunk.indices.push_back(remap[index]);
+        }
+    }
+    return chunks;
+}
+
+
+bounding_volume compute_bounds(const std::vector<vertex>& vertices)
+{
+    bounding_volume bounds;
+    if (vertices.empty()) {
+        return bounds;
+    }
+    bounds.aabb_min = vertices[0].position;
+    bounds.aabb_max = vertices[0].position;
+    for (int i = 1; i < vertices.size(); i++) {
+        bounds.aabb_min = glm::min(bounds.aabb_min, vertices[i].position);
+        bounds.aabb_max = glm::max(bounds.aabb_max, vertices[i].position);
+    }
+
+    bounds.center = (bounds.aabb_min + bounds.aabb_max) * 0.5f;
+    float radius_squared = 0;
+    for (int i = 0; i < vertices.size(); i++) {
+        glm::vec3 offset = vertices[i].position - bounds.center;
+        radius_squared = std::max(radius_squared, glm::dot(offset, offset));
+    }
+    bounds.radius = sqrt(radius_squared);
+    return bounds;
+}
+
+
+// transform is a regular column major matrix, unlike the transposed view and projection helpers
+bounding_volume transform_bounds(const bounding_volume& bounds, const glm::mat4& transform)
+{
+    bounding_volume result;
+    for (int i = 0; i < 3; i++) {
+        result.aabb_min[i] = transform[3][i];
+        result.aabb_max[i] = transform[3][i];
+        result.center[i] = transform[3][i];
+        for (int j = 0; j < 3; j++) {
+            float a = transform[j][i] * bounds.aabb_min[j];
+            float b = transform[j][i] * bounds.aabb_max[j];
+            result.aabb_min[i] += std::min(a, b);
+            result.aabb_max[i] += std::max(a, b);
+            result.center[i] += transform[j][i] * bounds.center[j];
+        }
+    }
+    float scale = 0;
+    for (int j = 0; j < 3; j++) {
+        scale = std::max(scale, glm::length(glm::vec3(transform[j].x, transform[j].y, transform[j].z)));
+    }
+    result.radius = bounds.radius * scale;
+    return result;
+}
+
+
+// clip is model * view * projection as built here, i.e. the transpose of the matrix the shader applies,
+// so its columns are the rows used by the Gribb-Hartmann plane extraction
+frustum extract_frustum(const glm::mat4& clip)
+{
+    frustum frs;
+    frs.planes[0] = clip[3] + clip[0];
+    frs.planes[1] = clip[3] - clip[0];
+    frs.planes[2] = clip[3] + clip[1];
+    frs.planes[3] = clip[3] - clip[1];
+    frs.planes[4] = clip[3] + clip[2];
+    frs.planes[5] = clip[3] - clip[2];
+    for (int i = 0; i < 6; i++) {
+        glm::vec4& plane = frs.planes[i];
+        plane = plane / glm::length(glm::vec3(plane.x, plane.y, plane.z));
+    }
+    return frs;
+}
+
+
+bool aabb_in_frustum(const frustum& frs, const bounding_volume& bounds)
+{
+    for (int i = 0; i < 6; i++) {
+        const glm::vec4& plane = frs.planes[i];
+        glm::vec3 farthest(
+            plane.x >= 0 ? bounds.aabb_max.x : bounds.aabb_min.x,
+            plane.y >= 0 ? bounds.aabb_max.y : bounds.aabb_min.y,
+            plane.z >= 0 ? bounds.aabb_max.z : bounds.aabb_min.z
+        );
+        if (glm::dot(glm::vec3(plane.x, plane.y, plane.z), farthest) + plane.w < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// spheres are stored as structure of arrays padded to a multiple of 4, tested 4 at a time
+void cull_spheres(const frustum& frs, const float* xs, const float* ys, const float* zs, const float* rs, 
+    size_t count, unsigned char* visible)
+{
+    #if defined(__SSE__) || defined(_M_X64)
+        for (size_t i = 0; i < count; i += 4) {
+            __m128 x = _mm_loadu_ps(xs + i);
+            __m128 y = _mm_loadu_ps(ys + i);
+            __m128 z = _mm_loadu_ps(zs + i);
+            __m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(rs + i));
+            __m128 inside;
+            for (int p = 0; p < 6; p++) {
+                const glm::vec4& plane = frs.planes[p];
+                __m128 distance = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+                    _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w))
+                );
+                __m128 plane_inside = _mm_cmpge_ps(distance, negative_radius);
+                inside = p == 0 ? plane_inside : _mm_and_ps(inside, plane_inside);
+            }
+            int mask = _mm_movemask_ps(inside);
+            for (int j = 0; j < 4; j++) {
+                visible[i + j] = (mask >> j) & 1;
+            }
+        }
+    #else
+        for (size_t i = 0; i < count; i++) {
+            visible[i] = 1;
+            for (int p = 0; p < 6; p++) {
+                const glm::vec4& plane = frs.planes[p];
+                if (plane.x * xs[i] + plane.y * ys[i] + plane.z * zs[i] + plane.w < -rs[i]) {
+                    visible[i] = 0;
+                    break;
+                }
+            }
+        }
+    #endif
+}
+
+
+struct sphere_list {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius;
+
+    void init(const std::vector<bounding_volume>& bounds)
+    {
+        size_t padded_count = (bounds.size() + 3) & ~(size_t) 3;
+        x.assign(padded_count, 0.f);
+        y.assign(padded_count, 0.f);
+        z.assign(padded_count, 0.f);
+        radius.assign(padded_count, 0.f);
+        for (int i = 0; i < bounds.size(); i++) {
+            x[i] = bounds[i].center.x;
+            y[i] = bounds[i].center.y;
+            z[i] = bounds[i].center.z;
+            radius[i] = bounds[i].radius;
+        }
+    }
+};
+
+
+int cull_flat(const frustum& frs, const sphere_list& spheres, const std::vector<bounding_volume>& bounds, unsigned char* visible)
+{
+    if (bounds.empty()) {
+        return 0;
+    }
+    cull_spheres(frs, &spheres.x[0], &spheres.y[0], &spheres.z[0], &spheres.radius[0], spheres.x.size(), visible);
+
+    int visible_count = 0;
+    for (int i = 0; i < bounds.size(); i++) {
+        if (visible[i] && !aabb_in_frustum(frs, bounds[i])) {
+            visible[i] = 0;
+        }
+        visible_count += visible[i];
+    }
+    return visible_count;
+}
+
+
+// plane_mask bit p set means the box may still cross plane p; returns -1 outside, 0 crossing, 1 inside
+int classify_aabb(const frustum& frs, const glm::vec3& aabb_min, const glm::vec3& aabb_max, int& plane_mask)
+{
+    for (int i = 0; i < 6; i++) {
+        if (!(plane_mask & (1 << i))) {
+            continue;
+        }
+        const glm::vec4& plane = frs.planes[i];
+        glm::vec3 normal(plane.x, plane.y, plane.z);
+        glm::vec3 farthest(
+            plane.x >= 0 ? aabb_max.x : aabb_min.x,
+            plane.y >= 0 ? aabb_max.y : aabb_min.y,
+            plane.z >= 0 ? aabb_max.z : aabb_min.z
+        );
+        glm::vec3 nearest(
+            plane.x >= 0 ? aabb_min.x : aabb_max.x,
+            plane.y >= 0 ? aabb_min.y : aabb_max.y,
+            plane.z >= 0 ? aabb_min.z : aabb_max.z
+        );
+        if (glm::dot(normal, farthest) + plane.w < 0) {
+            return -1;
+        }
+        if (glm::dot(normal, nearest) + plane.w >= 0) {
+            plane_mask &= ~(1 << i);
+        }
+    }
+    return plane_mask == 0 ? 1 : 0;
+}
+
+
+bool intersect_aabb(const glm::vec3& origin, const glm::vec3& inv_direction, 
+    const glm::vec3& aabb_min, const glm::vec3& aabb_max, float max_distance, float& distance)
+{
+    float t_min = 0, t_max = max_distance;
+    for (int i = 0; i < 3; i++) {
+        float t0 = (aabb_min[i] - origin[i]) * inv_direction[i];
+        float t1 = (aabb_max[i] - origin[i]) * inv_direction[i];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t_min = std::max(t_min, t0);
+        t_max = std::min(t_max, t1);
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    distance = t_min;
+    return true;
+}
+
+
+// nodes are flattened depth first: the left child directly follows its parent, offset holds the right child;
+// leaves keep count > 0 primitives starting at primitives[offset]
+struct bvh_node {
+    glm::vec3 aabb_min;
+    uint32_t offset;
+    glm::vec3 aabb_max;
+    uint32_t count;
+};
+
+
+class bvh {
+
+public:
+    std::vector<bvh_node> nodes;
+    std::vector<int> primitives;
+
+    void build(const std::vector<bounding_volume>& bounds)
+    {
+        nodes.clear();
+        primitives.resize(bounds.size());
+        centroids.resize(bounds.size());
+        for (int i = 0; i < bounds.size(); i++) {
+            primitives[i] = i;
+            centroids[i] = (bounds[i].aabb_min + bounds[i].aabb_max) * 0.5f;
+        }
+        if (!bounds.empty()) {
+            nodes.reserve(bounds.size() * 2 / BVH_LEAF_SIZE + 1);
+            build_node(bounds, 0, bounds.size(), 0);
+        }
+        std::vector<glm::vec3>().swap(centroids);
+    }
+
+    // marks primitives whose node is inside the frustum, crossing leaves are refined with the primitive bounds
+    int cull(const frustum& frs, const std::vector<bounding_volume>& bounds, unsigned char* visible) const
+    {
+        if (nodes.empty()) {
+            return 0;
+        }
+        int visible_count = 0;
+        std::pair<uint32_t, int> stack[BVH_MAX_DEPTH + 1];
+        int stack_size = 0;
+        stack[stack_size++] = std::make_pair(0u, 0x3F);
+        while (stack_size > 0) {
+            uint32_t index = stack[stack_size - 1].first;
+            int plane_mask = stack[stack_size - 1].second;
+            stack_size--;
+
+            const bvh_node& node = nodes[index];
+            int result = classify_aabb(frs, node.aabb_min, node.aabb_max, plane_mask);
+            if (result < 0) {
+                continue;
+            }
+            if (result > 0) {
+                visible_count += mark_subtree(index, visible);
+                continue;
+            }
+            if (node.count > 0) {
+                for (int i = 0; i < node.count; i++) {
+                    int primitive = primitives[node.offset + i];
+                    int primitive_mask = plane_mask;
+                    if (classify_aabb(frs, bounds[primitive].aabb_min, bounds[primitive].aabb_max, primitive_mask) >= 0) {
+                        visible[primitive] = 1;
+                        visible_count++;
+                    }
+                }
+                continue;
+            }
+            stack[stack_size++] = std::make_pair(node.offset, plane_mask);
+            stack[stack_size++] = std::make_pair(index + 1, plane_mask);
+        }
+        return visible_count;
+    }
+
+    bool intersect_ray(const glm::vec3& origin, const glm::vec3& direction, const std::vector<bounding_volume>& bounds,
+        int& hit, float& distance) const
+    {
+        hit = -1;
+        distance = 1e30f;
+        if (nodes.empty()) {
+            return false;
+        }
+        glm::vec3 inv_direction(1.f / direction.x, 1.f / direction.y, 1.f / direction.z);
+        uint32_t stack[BVH_MAX_DEPTH + 1];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const bvh_node& node = nodes[stack[--stack_size]];
+            float node_distance;
+            if (!intersect_aabb(origin, inv_direction, node.aabb_min, node.aabb_max, distance, node_distance)) {
+                continue;
+            }
+            if (node.count > 0) {
+                for (int i = 0; i < node.count; i++) {
+                    int primitive = primitives[node.offset + i];
+                    float primitive_distance;
+                    if (intersect_aabb(origin, inv_direction, bounds[primitive].aabb_min, bounds[primitive].aabb_max,
+                        distance, primitive_distance)) {
+                        hit = primitive;
+                        distance = primitive_distance;
+                    }
+                }
+                continue;
+            }
+            uint32_t left = & node - & nodes[0] + 1, right = node.offset;
+            float left_distance = 0, right_distance = 0;
+            bool left_hit = intersect_aabb(origin, inv_direction, nodes[left].aabb_min, nodes[left].aabb_max, distance, left_distance);
+            bool right_hit = intersect_aabb(origin, inv_direction, nodes[right].aabb_min, nodes[right].aabb_max, distance, right_distance);
+            if (left_hit && right_hit) {
+                // visit the nearer child first
+                stack[stack_size++] = left_distance < right_distance ? right : left;
+                stack[stack_size++] = left_distance < right_distance ? left : right;
+            }
+            else if (left_hit) {
+                stack[stack_size++] = left;
+            }
+            else if (right_hit) {
+                stack[stack_size++] = right;
+            }
+        }
+        return hit >= 0;
+    }
+
+    int get_depth(uint32_t index = 0) const
+    {
+        if (nodes.empty() || nodes[index].count > 0) {
+            return nodes.empty() ? 0 : 1;
+        }
+        return 1 + std::max(get_depth(index + 1), get_depth(nodes[index].offset));
+    }
+
+private:
+    std::vector<glm::vec3> centroids;
+
+    static float get_surface_area(const glm::vec3& aabb_min, const glm::vec3& aabb_max)
+    {
+        glm::vec3 extent = aabb_max - aabb_min;
+        return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
+    int mark_subtree(uint32_t index, unsigned char* visible) const
+    {
+        uint32_t end = index + 1;
+        while (nodes[end - 1].count == 0) {
+            end = nodes[end - 1].offset + 1;
+        }
+        const bvh_node& first = nodes[index];
+        const bvh_node& last = nodes[end - 1];
+        uint32_t first_primitive = first.count > 0 ? first.offset : find_first_primitive(index);
+        uint32_t last_primitive = last.offset + last.count;
+        for (uint32_t i = first_primitive; i < last_primitive; i++) {
+            visible[primitives[i]] = 1;
+        }
+        return last_primitive - first_primitive;
+    }
+
+    uint32_t find_first_primitive(uint32_t index) const
+    {
+        while (nodes[index].count == 0) {
+            index++;
+        }
+        return nodes[index].offset;
+    }
+
+    // binned SAH split along the longest centroid axis, primitives of a subtree stay contiguous
+    uint32_t build_node(const std::vector<bounding_volume>& bounds, size_t begin, size_t end, int depth)
+    {
+        uint32_t index = nodes.size();
+        nodes.push_back(bvh_node());
+
+        glm::vec3 aabb_min = bounds[primitives[begin]].aabb_min, aabb_max = bounds[primitives[begin]].aabb_max;
+        glm::vec3 centroid_min = centroids[primitives[begin]], centroid_max = centroid_min;
+        for (size_t i = begin + 1; i < end; i++) {
+            const bounding_volume& primitive = bounds[primitives[i]];
+            aabb_min = glm::min(aabb_min, primitive.aabb_min);
+            aabb_max = glm::max(aabb_max, primitive.aabb_max);
+            centroid_min = glm::min(centroid_min, centroids[primitives[i]]);
+            centroid_max = glm::max(centroid_max, centroids[primitives[i]]);
+        }
+        nodes[index].aabb_min = aabb_min;
+        nodes[index].aabb_max = aabb_max;
+
+        size_t count = end - begin;
+        glm::vec3 centroid_extent = centroid_max - centroid_min;
+        int axis = centroid_extent.x > centroid_extent.y ? 0 : 1;
+        axis = centroid_extent.z > centroid_extent[axis] ? 2 : axis;
+        if (count <= BVH_LEAF_SIZE || centroid_extent[axis] <= 0 || depth >= BVH_MAX_DEPTH - 1) {
+            nodes[index].offset = begin;
+            nodes[index].count = count;
+            return index;
+        }
+
+        int bin_count[BVH_BIN_COUNT] = {0};
+        glm::vec3 bin_min[BVH_BIN_COUNT], bin_max[BVH_BIN_COUNT];
+        float bin_scale = BVH_BIN_COUNT / centroid_extent[axis] * 0.9999f;
+        for (size_t i = begin; i < end; i++) {
+            const bounding_volume& primitive = bounds[primitives[i]];
+            int bin = (centroids[primitives[i]][axis] - centroid_min[axis]) * bin_scale;
+            bin_min[bin] = bin_count[bin] ? glm::min(bin_min[bin], primitive.aabb_min) : primitive.aabb_min;
+            bin_max[bin] = bin_count[bin] ? glm::max(bin_max[bin], primitive.aabb_max) : primitive.aabb_max;
+            bin_count[bin]++;
+        }
+
+        float left_area[BVH_BIN_COUNT - 1];
+        int left_count[BVH_BIN_COUNT - 1];
+        glm::vec3 sweep_min, sweep_max;
+        int sweep_count = 0;
+        for (int i = 0; i < BVH_BIN_COUNT - 1; i++) {
+            if (bin_count[i]) {
+                sweep_min = sweep_count ? glm::min(sweep_min, bin_min[i]) : bin_min[i];
+                sweep_max = sweep_count ? glm::max(sweep_max, bin_max[i]) : bin_max[i];
+                sweep_count += bin_count[i];
+            }
+            left_count[i] = sweep_count;
+            left_area[i] = sweep_count ? get_surface_area(sweep_min, sweep_max) : 0;
+        }
+
+        int best_split = -1;
+        float best_cost = count;
+        sweep_count = 0;
+        for (int i = BVH_BIN_COUNT - 1; i > 0; i--) {
+            if (bin_count[i]) {
+                sweep_min = sweep_count ? glm::min(sweep_min, bin_min[i]) : bin_min[i];
+                sweep_max = sweep_count ? glm::max(sweep_max, bin_max[i]) : bin_max[i];
+                sweep_count += bin_count[i];
+            }
+            if (!sweep_count || !left_count[i - 1]) {
+                continue;
+            }
+            // traversal cost of 1 against primitive tests weighted by the child surface area ratio
+            float cost = 1 + (left_area[i - 1] * left_count[i - 1] + get_surface_area(sweep_min, sweep_max) * sweep_count)
+                / get_surface_area(aabb_min, aabb_max);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = i;
+            }
+        }
+
+        size_t middle;
+        if (best_split < 0) {
+            if (count <= BVH_LEAF_SIZE * 4) {
+                nodes[index].offset = begin;
+                nodes[index].count = count;
+                return index;
+            }
+            middle = begin + count / 2;
+            std::nth_element(primitives.begin() + begin, primitives.begin() + middle, primitives.begin() + end,
+                [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+        }
+        else {
+            float split_position = centroid_min[axis] + best_split / bin_scale;
+            middle = std::partition(primitives.begin() + begin, primitives.begin() + end,
+                [&](int primitive) { return centroids[primitive][axis] < split_position; }) - primitives.begin();
+            if (middle == begin || middle == end) {
+                middle = begin + count / 2;
+            }
+        }
+
+        build_node(bounds, begin, middle, depth + 1);
+        uint32_t right = build_node(bounds, middle, end, depth + 1);
+        nodes[index].offset = right;
+        nodes[index].count = 0;
+        return index;
+    }
+};
+
+
+uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(& bits, & value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = ((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        return sign | ((mantissa >> (14 - exponent)) + ((mantissa >> (13 - exponent)) & 1));
+    }
+    if (exponent >= 31) {
+        return sign | 0x7C00;
+    }
+    return sign | ((exponent << 10) + (mantissa >> 13) + ((mantissa >> 12) & 1));
+}
+
+
+float half_to_float(uint16_t value)
+{
+    uint32_t sign = (value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1F;
+    uint32_t mantissa = value & 0x3FF;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        float result = mantissa / 16777216.0f;
+        return sign ? -result : result;
+    }
+    if (exponent == 31) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float result;
+    memcpy(& result, & bits, sizeof(result));
+    return result;
+}
+
+
+int16_t float_to_snorm(float value)
+{
+    return (int16_t) floor(glm::clamp(value, -1.0f, 1.0f) * 32767.0f + 0.5f);
+}
+
+
+float snorm_to_float(int16_t value)
+{
+    return glm::max(value / 32767.0f, -1.0f);
+}
+
+
+glm::vec2 encode_octahedral(glm::vec3 nrm)
+{
+    nrm = nrm / (fabs(nrm.x) + fabs(nrm.y) + fabs(nrm.z));
+    if (nrm.z >= 0) {
+        return glm::vec2(nrm.x, nrm.y);
+    }
+    return glm::vec2(
+        (1.0f - fabs(nrm.y)) * (nrm.x >= 0 ? 1.0f : -1.0f),
+        (1.0f - fabs(nrm.x)) * (nrm.y >= 0 ? 1.0f : -1.0f)
+    );
+}
+
+
+glm::vec3 decode_octahedral(glm::vec2 oct)
+{
+    glm::vec3 nrm(oct.x, oct.y, 1.0f - fabs(oct.x) - fabs(oct.y));
+    float t = glm::max(-nrm.z, 0.0f);
+    nrm.x += nrm.x >= 0 ? -t : t;
+    nrm.y += nrm.y >= 0 ? -t : t;
+    return glm::normalize(nrm);
+}
+
+
+std::vector<packed_vertex> pack_vertices(const vertex* vertices, size_t vertex_count, glm::vec3& offset, glm::vec3& scale)
+{
+    if (vertex_count == 0) {
+        offset = glm::vec3(0.0f);
+        scale = glm::vec3(1.0f);
+        return std::vector<packed_vertex>();
+    }
+
+    glm::vec3 lower(vertices[0].position), upper(vertices[0].position);
+    for (int i = 1; i < vertex_count; i++) {
+        lower = glm::min(lower, vertices[i].position);
+        upper = glm::max(upper, vertices[i].position);
+    }
+    offset = (lower + upper) * 0.5f;
+    scale = (upper - lower) * 0.5f;
+    for (int j = 0; j < 3; j++) {
+        if (scale[j] <= 0) {
+            scale[j] = 1.0f;
+        }
+    }
+
+    std::vector<packed_vertex> packed(vertex_count);
+    packing_error error;
+    for (int i = 0; i < vertex_count; i++) {
+        const vertex& vtx = vertices[i];
+        packed_vertex& pvx = packed[i];
+        glm::vec3 nrm = glm::length(vtx.normal) > 0 ? glm::normalize(vtx.normal) : glm::vec3(0., 0., 1.);
+        glm::vec2 oct = encode_octahedral(nrm);
+        glm::vec3 relative = (vtx.position - offset) / scale;
+
+        for (int j = 0; j < 3; j++) {
+            pvx.position[j] = float_to_snorm(relative[j]);
+        }
+        pvx.position[3] = 0;
+        pvx.texcoord[0] = float_to_half(vtx.texcoord.x);
+        pvx.texcoord[1] = float_to_half(vtx.texcoord.y);
+        pvx.normal[0] = float_to_snorm(oct.x);
+        pvx.normal[1] = float_to_snorm(oct.y);
+
+        glm::vec3 position = offset + glm::vec3(
+            snorm_to_float(pvx.position[0]), snorm_to_float(pvx.position[1]), snorm_to_float(pvx.position[2])
+        ) * scale;
+        glm::vec3 normal = decode_octahedral(glm::vec2(snorm_to_float(pvx.normal[0]), snorm_to_float(pvx.normal[1])));
+        float cosine = glm::clamp(glm::dot(normal, nrm), -1.0f, 1.0f);
+
+        error.position = glm::max(error.position, glm::length(position - vtx.position));
+        error.texcoord = glm::max(error.texcoord, glm::max(
+            fabs(half_to_float(pvx.texcoord[0]) - vtx.texcoord.x),
+            fabs(half_to_float(pvx.texcoord[1]) - vtx.texcoord.y)
+        ));
+        error.normal_degrees = glm::max(error.normal_degrees, glm::degrees(acos(cosine)));
+    }
+
+    packing_stats.position = glm::max(packing_stats.position, error.position);
+    packing_stats.texcoord = glm::max(packing_stats.texcoord, error.texcoord);
+    packing_stats.normal_degrees = glm::max(packing_stats.normal_degrees, error.normal_degrees);
+    packing_stats.vertex_count += vertex_count;
+    return packed;
+}
+
+
+GLenum get_index_type(size_t vertex_count)
+{
+    #ifdef SHORT_INDICES
+        if (vertex_count <= MAX_SHORT_INDEX_VERTICES) {
+            return GL_UNSIGNED_SHORT;
+        }
+    #endif
+    return GL_UNSIGNED_INT;
+}
+
+
+size_t get_index_size(GLenum index_type)
+{
+    return index_type == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+}
+
+
+size_t get_padded_size(size_t bytes)
+{
+    return (bytes + 3) & ~(size_t) 3;
+}
+
+
+bool hash_file(const char* file_path, uint64_t& hash)
+{
+    FILE* fp = fopen(file_path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    std::vector<unsigned char> buffer(1 << 20);
+    hash = fnv1a_hash(NULL, 0);
+    size_t count;
+    while ((count = fread(&buffer[0], 1, buffer.size(), fp)) > 0) {
+        hash = fnv1a_hash(&buffer[0], count, hash);
+    }
+    fclose(fp);
+    return true;
+}
+
+
+bool get_file_stamp(const char* file_path, uint64_t& size, int64_t& mtime)
+{
+    struct stat info;
+    if (stat(file_path, & info) != 0) {
+        return false;
+    }
+    size = info.st_size;
+    mtime = info.st_mtime;
+    return true;
+}
+
+
+class mapped_file {
+
+public:
+    const unsigned char* data;
+    size_t size;
+
+    mapped_file() : data(NULL), size(0) {}
+
+    ~mapped_file() { close(); }
+
+    bool open(const char* file_path)
+    {
+        #ifdef _WIN32
+            file_handle = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file_handle == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            LARGE_INTEGER file_size;
+            GetFileSizeEx(file_handle, & file_size);
+            size = file_size.QuadPart;
+            map_handle = size ? CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+            data = map_handle ? (const unsigned char*) MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0) : NULL;
+        #else
+            fd = ::open(file_path, O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat info;
+            fstat(fd, & info);
+            size = info.st_size;
+            void* ptr = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            data = ptr != MAP_FAILED ? (const unsigned char*) ptr : NULL;
+        #endif
+
+        if (!data) {
+            close();
+            return false;
+        }
+        memory_stats.allocate_cpu(size);
+        return true;
+    }
+
+    void close()
+    {
+        if (data) {
+            memory_stats.release_cpu(size);
+        }
+        #ifdef _WIN32
+            if (data) UnmapViewOfFile(data);
+            if (map_handle) CloseHandle(map_handle);
+            if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+            map_handle = NULL;
+            file_handle = INVALID_HANDLE_VALUE;
+        #else
+            if (data) munmap((void*) data, size);
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        #endif
+        data = NULL;
+        size = 0;
+    }
+
+private:
+    #ifdef _WIN32
+        HANDLE file_handle = INVALID_HANDLE_VALUE;
+        HANDLE map_handle = NULL;
+    #else
+        int fd = -1;
+    #endif
+};
+
+
+struct image {
+    int width;
+    int height;
+    int channels;
+    unsigned char* content;
+    uint64_t hash;
+
+    image() : width(0), height(0), channels(0), content(NULL), hash(0) {}
+};
+
+
+image decode_image(const std::string& path)
+{
+    image img;
+    img.content = stbi_load(path.c_str(), & img.width, & img.height, & img.channels, 0);
+    if (img.content) {
+        memory_stats.allocate_cpu((size_t) img.width * img.height * img.channels);
+        int shape[3] = {img.width, img.height, img.channels};
+        img.hash = fnv1a_hash(shape, sizeof(shape));
+        img.hash = fnv1a_hash(img.content, (size_t) img.width * img.height * img.channels, img.hash);
+    }
+    return img;
+}
+
+
+void free_image(image& img)
+{
+    if (img.content) {
+        memory_stats.release_cpu((size_t) img.width * img.height * img.channels);
+        stbi_image_free(img.content);
+        img.content = NULL;
+    }
+}
+
+
+class texture {
+
+public:
+    GLuint TEX;
+
+    const char* image_path;
+    unsigned char* content;
+
+    texture() {}
+
+    texture(image& img, const char* path) {
+            image_path = path;
+            loaded = true;
+            width = img.width;
+            height = img.height;
+            channels = img.channels;
+            content = img.content;
+            img.content = NULL;
+            upload_image();
+    }
+
+    ~texture() {}
+
+    void load_default_color()
+    {
+        TEX = get_default_texture();
+        width = DEFAULT_TEXTURE_SIZE;
+        height = DEFAULT_TEXTURE_SIZE;
+        channels = 3;
+        content = NULL;
+    }
+
+    static GLuint get_default_texture()
+    {
+        static GLuint default_TEX = 0;
+        if (!default_TEX) {
+            unsigned char pixels[DEFAULT_TEXTURE_SIZE * DEFAULT_TEXTURE_SIZE * 3];
+            memset(pixels, DEFAULT_TEXTURE_COLOR, sizeof(pixels));
+
+            glGenTextures(1, & default_TEX);
+            glBindTexture(GL_TEXTURE_2D, default_TEX);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, DEFAULT_TEXTURE_SIZE, DEFAULT_TEXTURE_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            set_texture_parameter();
+            memory_stats.gpu_texture_bytes += sizeof(pixels);
+        }
+        return default_TEX;
+    }
+
+    static size_t get_texture_bytes(int width, int height, int channels, bool mipmap)
+    {
+        size_t bytes = (size_t) width * height * channels;
+        return mipmap ? bytes * 4 / 3 : bytes;
+    }
+
+    bool is_loaded() { return loaded; }
+
+private:
+    int width;
+    int height;
+    int channels;
+
+    bool loaded;
+
+    void release_image()
+    {
+        memory_stats.release_cpu(get_texture_bytes(width, height, channels, false));
+        stbi_image_free(content);
+        content = NULL;
+    }
+
+    void upload_image()
+    {
+        if (!content) {
+            std::cerr << "[WARNING] can not load image: " << image_path << std::endl;
+            load_default_color();
+            loaded = false;
+            return;
+        }
+        create_texture_buffer();
+        memory_stats.gpu_texture_bytes += get_texture_bytes(width, height, channels, true);
+        release_image();
+    } 
+
+    GLenum get_image_format_type(int channels)
+    {
+        switch (channels)
+        {
+            case 1: return GL_RED;
+            case 3: return GL_RGB;
+            case 4: return GL_RGBA;
+            default: return GL_RGB;
+        }
+    }
+
+    void create_texture_buffer()
+    {
+        GLenum format = get_image_format_type(channels);
+
+        glGenTextures(1, & TEX);
+        glBindTexture(GL_TEXTURE_2D, TEX);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, content);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        set_texture_parameter();
+    }
+
+    static void set_texture_parameter()
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+};
+
+
+struct texture_entry {
+    std::string path;
+    GLuint TEX;
+    uint64_t content_hash;
+    int uses;
+    int hits;
+};
+
+
+class texture_cache {
+
+public:
+    std::vector<texture_entry> entries;
+
+    int requests;
+    int path_hits;
+    int content_hits;
+    int missing_images;
+
+    texture_cache() : requests(0), path_hits(0), content_hits(0), missing_images(0) {}
+
+    bool contains(const std::string& path)
+    {
+        return path_index.find(path) != path_index.end();
+    }
+
+    // duplicates are found while every decoded image is still in memory, the hash only selects candidates for memcmp
+    void insert(const std::vector<std::string>& paths, const std::string& dir, std::vector<image>& images)
+    {
+        std::vector<int> duplicate_of(images.size(), -1);
+        std::unordered_map<uint64_t, std::vector<int> > candidates;
+        for (int i = 0; i < images.size(); i++) {
+            if (!images[i].content) {
+                continue;
+            }
+            std::vector<int>& same_hash = candidates[images[i].hash];
+            for (int j = 0; j < same_hash.size() && duplicate_of[i] < 0; j++) {
+                if (same_content(images[same_hash[j]], images[i])) {
+                    duplicate_of[i] = same_hash[j];
+                }
+            }
+            if (duplicate_of[i] < 0) {
+                same_hash.push_back(i);
+            }
+        }
+
+        for (int i = 0; i < images.size(); i++) {
+            if (duplicate_of[i] < 0) {
+                insert(paths[i], dir + "/" + paths[i], images[i]);
+            }
+        }
+        for (int i = 0; i < images.size(); i++) {
+            if (duplicate_of[i] >= 0) {
+                path_index[paths[i]] = path_index[paths[duplicate_of[i]]];
+                content_hits++;
+                free_image(images[i]);
+            }
+        }
+    }
+
+    void insert(const std::string& path, const std::string& abs_path, image& img)
+    {
+        std::cout << abs_path << std::endl;
+        uint64_t content_hash = img.hash;
+        texture tex = texture(img, abs_path.c_str());
+        if (!tex.is_loaded()) {
+            missing_images++;
+        }
+
+        texture_entry entry;
+        entry.path = path;
+        entry.TEX = tex.TEX;
+        entry.content_hash = content_hash;
+        entry.uses = 0;
+        entry.hits = 0;
+
+        path_index[path] = entries.size();
+        entries.push_back(entry);
+    }
+
+    GLuint acquire(const std::string& path)
+    {
+        texture_entry& entry = entries[path_index[path]];
+        requests++;
+        if (entry.uses++ > 0) {
+            entry.hits++;
+            path_hits++;
+        }
+        return entry.TEX;
+    }
+
+    void report()
+    {
+        std::cout << "[INFO] texture cache: " << requests << " requests, "
+            << path_index.size() << " paths, " << entries.size() << " textures, "
+            << path_hits << " hits, " << content_hits << " duplicate images, "
+            << missing_images << " missing images sharing the default texture" << std::endl;
+        std::cout << "[INFO] texture memory: gpu " << memory_stats.gpu_texture_bytes / 1024 << " KB" << std::endl;
+        for (int i = 0; i < entries.size(); i++) {
+            std::cout << "    " << entries[i].path << ": " << entries[i].uses << " uses, " << entries[i].hits << " hits" << std::endl;
+        }
+    }
+
+private:
+    std::unordered_map<std::string, int> path_index;
+
+    static bool same_content(const image& a, const image& b)
+    {
+        return a.width == b.width && a.height == b.height && a.channels == b.channels &&
+            memcmp(a.content, b.content, (size_t) a.width * a.height * a.channels) == 0;
+    }
+};
+
+
+void set_vertex_attributes()
+{
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+
+    #ifdef PACKED_VERTEX
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, sizeof(packed_vertex), 0);
+        glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(packed_vertex), (const GLvoid*) 8);
+        glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, sizeof(packed_vertex), (const GLvoid*) 12);
+    #else
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), 0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (const GLvoid*) 12);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (const GLvoid*) 20);
+    #endif
+}
+
+
+size_t get_vertex_stride()
+{
+    #ifdef PACKED_VERTEX
+        return sizeof(packed_vertex);
+    #else
+        return sizeof(vertex);
+    #endif
+}
+
+
+struct draw_instance {
+    glm::mat4 transform;
+    GLfloat layer;
+    glm::vec3 quant_offset;
+    glm::vec3 quant_scale;
+};
+
+
+// per instance attributes read from the bound instance buffer, the transform takes locations 6 to 9
+void set_instance_attributes()
+{
+    for (int i = 3; i < 10; i++) {
+        glEnableVertexAttribArray(i);
+        glVertexAttribDivisor(i, 1);
+    }
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(draw_instance), (const GLvoid*) 64);
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(draw_instance), (const GLvoid*) 68);
+    glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, sizeof(draw_instance), (const GLvoid*) 80);
+    for (int i = 0; i < 4; i++) {
+        glVertexAttribPointer(6 + i, 4, GL_FLOAT, GL_FALSE, sizeof(draw_instance), (const GLvoid*) (i * sizeof(glm::vec4)));
+    }
+}
+
+
+class scene_buffer {
+
+public:
+    GLuint VAO;
+    GLuint VBO;
+    GLuint IBO;
+
+    size_t vertex_count;
+    size_t index_bytes;
+
+    scene_buffer() : VAO(0), VBO(0), IBO(0), vertex_count(0), index_bytes(0) {}
+
+    void create(size_t total_vertices, size_t total_index_bytes)
+    {
+        glGenVertexArrays(1, & VAO);
+        glBindVertexArray(VAO);
+
+        glGenBuffers(1, & VBO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, total_vertices * get_vertex_stride(), NULL, GL_STATIC_DRAW);
+        set_vertex_attributes();
+
+        glGenBuffers(1, & IBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, total_index_bytes, NULL, GL_STATIC_DRAW);
+
+        memory_stats.gpu_buffer_bytes += total_vertices * get_vertex_stride() + total_index_bytes;
+    }
+
+    GLint append_vertices(const void* vertices, size_t count)
+    {
+        GLint base_vertex = vertex_count;
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferSubData(GL_ARRAY_BUFFER, vertex_count * get_vertex_stride(), count * get_vertex_stride(), vertices);
+        vertex_count += count;
+        return base_vertex;
+    }
+
+    size_t append_indices(const void* indices, size_t count, GLenum index_type)
+    {
+        size_t offset = index_bytes;
+        size_t bytes = count * get_index_size(index_type);
+        glBindVertexArray(VAO);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, bytes, indices);
+        index_bytes += get_padded_size(bytes);
+        return offset;
+    }
+};
+
+
+class mesh {
+
+public:
+
+    GLuint VAO;
+    GLuint TEX;
+    GLuint program;
+    GLuint index_size;
+    GLenum index_type;
+
+    GLint base_vertex;
+    size_t index_offset;
+
+    glm::vec3 quant_offset;
+    glm::vec3 quant_scale;
+
+    bounding_volume bounds;
+
+    int first_instance;
+    int instance_count;
+    GLuint visible_first;
+    GLsizei visible_count;
+
+    mesh() {}
+
+    mesh(const std::vector<vertex>& vertices, const std::vector<unsigned int>& indices, GLuint tex_id, scene_buffer* buffer = NULL) 
+    {
+        if (vertices.empty() || indices.empty()) {
+            init_empty(tex_id);
+            return;
+        }
+        create_vertex_buffer(&vertices[0], vertices.size(), buffer);
+        if (get_index_type(vertices.size()) == GL_UNSIGNED_SHORT) {
+            std::vector<unsigned short> short_indices(indices.begin(), indices.end());
+            create_index_buffer(&short_indices[0], short_indices.size(), GL_UNSIGNED_SHORT, buffer);
+        }
+        else {
+            create_index_buffer(&indices[0], indices.size(), GL_UNSIGNED_INT, buffer);
+        }
+        TEX = tex_id;
+        program = 0;
+        first_instance = instance_count = 0;
+        visible_first = visible_count = 0;
+    }
+
+    mesh(const vertex* vertices, size_t vertex_count, const void* indices, size_t index_count, GLenum idx_type, GLuint tex_id, scene_buffer* buffer = NULL) 
+    {
+        if (vertex_count == 0 || index_count == 0) {
+            init_empty(tex_id);
+            return;
+        }
+        create_vertex_buffer(vertices, vertex_count, buffer);
+        create_index_buffer(indices, index_count, idx_type, buffer);
+        TEX = tex_id;
+        program = 0;
+        first_instance = instance_count = 0;
+        visible_first = visible_count = 0;
+    }
+
+    void init_empty(GLuint tex_id)
+    {
+        VAO = 0;
+        TEX = tex_id;
+        program = 0;
+        index_size = 0;
+        index_type = GL_UNSIGNED_INT;
+        base_vertex = 0;
+        index_offset = 0;
+        quant_offset = glm::vec3(0.0f);
+        quant_scale = glm::vec3(1.0f);
+        first_instance = instance_count = 0;
+        visible_first = visible_count = 0;
+    }
+
+    void create_vertex_array()
+    {
+        glGenVertexArrays(1, & VAO);
+        glBindVertexArray(VAO);
+    }
+
+    void create_vertex_buffer(const vertex* vertices, size_t vertex_count, scene_buffer* buffer)
+    {
+        #ifdef PACKED_VERTEX
+            std::vector<packed_vertex> packed = pack_vertices(vertices, vertex_count, quant_offset, quant_scale);
+            const void* data = packed.empty() ? NULL : &packed[0];
+        #else
+            const void* data = vertices;
+            quant_offset = glm::vec3(0.0f);
+            quant_scale = glm::vec3(1.0f);
+        #endif
+
+        if (buffer) {
+            VAO = buffer->VAO;
+            base_vertex = buffer->append_vertices(data, vertex_count);
+            return;
+        }
+
+        create_vertex_array();
+        base_vertex = 0;
+        int buffer_size = get_vertex_stride() * vertex_count;
+        GLuint VBO;
+        glGenBuffers(1, & VBO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, buffer_size, data, GL_STATIC_DRAW);
+        set_vertex_attributes();
+        memory_stats.gpu_buffer_bytes += buffer_size;
+    }
+
+    void create_index_buffer(const void* indices, size_t index_count, GLenum idx_type, scene_buffer* buffer)
+    {
+        index_size = index_count;
+        index_type = idx_type;
+
+        if (buffer) {
+            index_offset = buffer->append_indices(indices, index_count, index_type);
+            return;
+        }
+
+        index_offset = 0;
+        int buffer_size = get_index_size(index_type) * index_size;
+        GLuint IBO;
+        glGenBuffers(1, & IBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, buffer_size, indices, GL_STATIC_DRAW);
+        memory_stats.gpu_buffer_bytes += buffer_size;
+
+    }
+};
+
+
+struct draw_item {
+    uint64_t key;
+    uint32_t state_rank;
+    int mesh_index;
+
+    bool operator<(const draw_item& other) const { return key < other.key; }
+};
+
+
+struct draw_batch {
+    GLuint VAO;
+    GLuint TEX;
+    GLuint program;
+    GLenum index_type;
+
+    std::vector<int> meshes;
+};
+
+
+struct draw_indirect_command {
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
+};
+
+
+struct indirect_group {
+    GLuint texture_array;
+    GLenum index_type;
+    size_t command_offset;
+    GLsizei command_count;
+};
+
+
+struct texture_layer {
+    int array_index;
+    int layer;
+};
+
+
+class scene {
+
+public:
+    std::string scene_path;
+    std::string scene_dir;
+
+    std::vector<mesh> scene_meshes;
+    std::vector<mesh_instance> scene_instances;
+    std::vector<draw_item> draw_list;
+    std::vector<draw_batch> draw_batches;
+    bool draw_list_dirty;
+    GLuint draw_program;
+    draw_sort_mode sorted_mode;
+    std::vector<float> mesh_distances;
+
+    scene_buffer shared_buffer;
+
+    GLuint indirect_VAO;
+    GLuint indirect_buffer;
+    GLuint instance_buffer;
+    std::vector<GLuint> texture_arrays;
+    std::vector<indirect_group> indirect_groups;
+    std::vector<draw_indirect_command> indirect_commands;
+    std::vector<int> indirect_meshes;
+
+    std::vector<draw_instance> instance_records;
+    std::vector<draw_instance> visible_records;
+
+    std::vector<bounding_volume> instance_bounds;
+    sphere_list instance_spheres;
+    bvh instance_bvh;
+    std::vector<unsigned char> instance_visible;
+    
+    texture_cache textures;
+
+    int import_threads;
+
+    scene() {}
+
+    scene(std::string path, GLuint program)
+    {
+        scene_path = path;
+        draw_program = program;
+        indirect_VAO = 0;
+        draw_list_dirty = true;
+        sorted_mode = SORT_STATE;
+        import_threads = get_import_thread_count();
+        scene_dir = get_scene_dir();
+
+        load_scene();
+    }
+
+
+    std::string get_scene_dir()
+    {
+        std::string::size_type slash_index = scene_path.find_last_of("/\\");
+        std::string scene_dir;
+
+        if (slash_index == std::string::npos) {
+            scene_dir = ".";
+        }
+        else if (slash_index == 0) {
+            scene_dir = "/";
+        }
+        else {
+            scene_dir = scene_path.substr(0, slash_index);
+        }
+        return scene_dir;
+    }
+
+    void load_scene()
+    {
+        float start_time = glfwGetTime();
+
+        #ifdef MESH_CACHE
+            if (load_mesh_cache()) {
+                std::cout << "[INFO] scene loaded from mesh cache in " << (glfwGetTime() - start_time) * 1000 << " ms" << std::endl;
+                init_draw_data();
+                report_scene();
+                return;
+            }
+        #endif
+
+        Assimp::Importer importer;
+
+        const aiScene* scene_ptr = importer.ReadFile(
+            scene_path.c_str(), 
+            aiProcess_Triangulate |
+            aiProcess_GenSmoothNormals | 
+            aiProcess_FlipUVs
+        );
+
+        if (!scene_ptr) {
+            std::cerr << "[ERROR] load scene failed:" << scene_path << std::endl;
+            std::cerr << importer.GetErrorString();
+            exit(1);
+        }
+
+        #ifdef IMPORT_BENCHMARK
+            benchmark_import(scene_ptr);
+        #endif
+
+        std::vector<mesh_data> mesh_list = init_scene(scene_ptr, import_threads);
+        std::vector<mesh_instance> instances;
+        init_node(scene_ptr->mRootNode, aiMatrix4x4(), instances);
+
+        #ifdef WELD_VERTICES
+            weld_scene(mesh_list);
+        #endif
+
+        #ifdef OPTIMIZE_MESHES
+            optimize_scene(mesh_list);
+        #endif
+
+        #ifdef SHORT_INDICES
+            split_scene(mesh_list);
+        #endif
+
+        remap_instances(mesh_list, instances);
+
+        #ifdef MESH_CACHE
+            save_mesh_cache(mesh_list, instances);
+        #endif
+
+        std::vector<std::string> texture_paths(mesh_list.size());
+        for (int i = 0; i < mesh_list.size(); i++) {
+            texture_paths[i] = mesh_list[i].texture_path;
+        }
+        std::vector<GLuint> texture_ids = init_textures(texture_paths);
+
+        #ifdef SCENE_BUFFER
+            size_t total_vertices = 0, total_index_bytes = 0;
+            for (int i = 0; i < mesh_list.size(); i++) {
+                size_t vertex_count = mesh_list[i].vertices.size();
+                total_vertices += vertex_count;
+                total_index_bytes += get_padded_size(mesh_list[i].indices.size() * get_index_size(get_index_type(vertex_count)));
+            }
+            shared_buffer.create(total_vertices, total_index_bytes);
+        #endif
+
+        for (int i = 0; i < mesh_list.size(); i++) {
+            mesh_data& data = mesh_list[i];
+            scene_meshes.push_back(mesh(data.vertices, data.indices, texture_ids[i], get_scene_buffer()));
+            scene_meshes.back().program = draw_program;
+            scene_meshes.back().bounds = data.bounds;
+            release_mesh_data(data);
+        }
+        set_scene_instances(instances);
+        std::cout << "[INFO] scene loaded from assimp in " << (glfwGetTime() - start_time) * 1000 << " ms" << std::endl;
+        init_draw_data();
+        report_scene();
+    }
+
+    void init_draw_data()
+    {
+        update_draw_list();
+        init_cull_data();
+        init_instance_buffer();
+        update_visible_instances();
+    }
+
+    // walks the node graph, each mesh reference becomes an instance with the accumulated node transform
+    void init_node(const aiNode* node, const aiMatrix4x4& parent_transform, std::vector<mesh_instance>& instances)
+    {
+        aiMatrix4x4 transform = parent_transform * node->mTransformation;
+        for (int i = 0; i < node->mNumMeshes; i++) {
+            mesh_instance instance;
+            instance.mesh_index = node->mMeshes[i];
+            instance.transform = glm::mat4(
+                transform.a1, transform.b1, transform.c1, transform.d1,
+                transform.a2, transform.b2, transform.c2, transform.d2,
+                transform.a3, transform.b3, transform.c3, transform.d3,
+                transform.a4, transform.b4, transform.c4, transform.d4
+            );
+            instances.push_back(instance);
+        }
+        for (int i = 0; i < node->mNumChildren; i++) {
+            init_node(node->mChildren[i], transform, instances);
+        }
+    }
+
+    // instances reference assimp meshes, map them onto the meshes left after splitting
+    void remap_instances(const std::vector<mesh_data>& mesh_list, std::vector<mesh_instance>& instances)
+    {
+        std::vector<std::vector<int> > source_meshes;
+        for (int i = 0; i < mesh_list.size(); i++) {
+            int source = mesh_list[i].source_mesh;
+            if (source >= source_meshes.size()) {
+                source_meshes.resize(source + 1);
+            }
+            source_meshes[source].push_back(i);
+        }
+
+        std::vector<mesh_instance> remapped;
+        for (int i = 0; i < instances.size(); i++) {
+            if (instances[i].mesh_index >= source_meshes.size()) {
+                continue;
+            }
+            const std::vector<int>& meshes = source_meshes[instances[i].mesh_index];
+            for (int j = 0; j < meshes.size(); j++) {
+                remapped.push_back(instances[i]);
+                remapped.back().mesh_index = meshes[j];
+            }
+        }
+        instances.swap(remapped);
+    }
+
+    void set_scene_instances(std::vector<mesh_instance>& instances)
+    {
+        std::stable_sort(instances.begin(), instances.end(), 
+            [](const mesh_instance& a, const mesh_instance& b) { return a.mesh_index < b.mesh_index; });
+        scene_instances.swap(instances);
+
+        for (int i = 0; i < scene_instances.size(); i++) {
+            mesh& msh = scene_meshes[scene_instances[i].mesh_index];
+            if (msh.instance_count == 0) {
+                msh.first_instance = i;
+            }
+            msh.instance_count++;
+            scene_instances[i].bounds = transform_bounds(msh.bounds, scene_instances[i].transform);
+        }
+    }
+
+    void init_instance_buffer()
+    {
+        instance_records.resize(scene_instances.size());
+        for (int i = 0; i < scene_instances.size(); i++) {
+            const mesh& msh = scene_meshes[scene_instances[i].mesh_index];
+            instance_records[i].transform = scene_instances[i].transform;
+            instance_records[i].layer = 0;
+            instance_records[i].quant_offset = msh.quant_offset;
+            instance_records[i].quant_scale = msh.quant_scale;
+        }
+
+        glGenBuffers(1, & instance_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        glBufferData(GL_ARRAY_BUFFER, instance_records.size() * sizeof(draw_instance), NULL, GL_DYNAMIC_DRAW);
+        memory_stats.gpu_buffer_bytes += instance_records.size() * sizeof(draw_instance);
+
+        std::unordered_set<GLuint> arrays;
+        for (int i = 0; i < scene_meshes.size(); i++) {
+            if (arrays.insert(scene_meshes[i].VAO).second) {
+                glBindVertexArray(scene_meshes[i].VAO);
+                set_instance_attributes();
+            }
+        }
+        glBindVertexArray(0);
+    }
+
+    // packs the transforms of visible instances per mesh, the draws read them back through base instance
+    void update_visible_instances()
+    {
+        visible_records.clear();
+        for (int i = 0; i < scene_meshes.size(); i++) {
+            mesh& msh = scene_meshes[i];
+            msh.visible_first = visible_records.size();
+            for (int j = msh.first_instance; j < msh.first_instance + msh.instance_count; j++) {
+                if (instance_visible[j]) {
+                    visible_records.push_back(instance_records[j]);
+                }
+            }
+            msh.visible_count = visible_records.size() - msh.visible_first;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, visible_records.size() * sizeof(draw_instance), visible_records.data());
+
+        if (!indirect_commands.empty()) {
+            for (int i = 0; i < indirect_commands.size(); i++) {
+                const mesh& msh = scene_meshes[indirect_meshes[i]];
+                indirect_commands[i].instance_count = msh.visible_count;
+                indirect_commands[i].base_instance = msh.visible_first;
+            }
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+            glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, indirect_commands.size() * sizeof(draw_indirect_command), indirect_commands.data());
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+    }
+
+    // a reloaded shader is a new program object, meshes and batches move to it without touching the scene data
+    void replace_program(GLuint old_program, GLuint new_program)
+    {
+        if (draw_program == old_program) {
+            draw_program = new_program;
+        }
+        for (int i = 0; i < scene_meshes.size(); i++) {
+            if (scene_meshes[i].program == old_program) {
+                scene_meshes[i].program = new_program;
+            }
+        }
+        for (int i = 0; i < draw_batches.size(); i++) {
+            if (draw_batches[i].program == old_program) {
+                draw_batches[i].program = new_program;
+            }
+        }
+    }
+
+    scene_buffer* get_scene_buffer()
+    {
+        #ifdef SCENE_BUFFER
+            return & shared_buffer;
+        #else
+            return NULL;
+        #endif
+    }
+
+    // key layout, most expensive state first: program 16 bits | texture 24 bits | VAO 23 bits | index type 1 bit
+    uint64_t get_draw_key(const mesh& msh, std::unordered_map<GLuint, uint64_t>& programs,
+        std::unordered_map<GLuint, uint64_t>& textures, std::unordered_map<GLuint, uint64_t>& arrays)
+    {
+        uint64_t program_rank = programs.insert(std::make_pair(msh.program, (uint64_t) programs.size())).first->second;
+        uint64_t texture_rank = textures.insert(std::make_pair(msh.TEX, (uint64_t) textures.size())).first->second;
+        uint64_t array_rank = arrays.insert(std::make_pair(msh.VAO, (uint64_t) arrays.size())).first->second;
+        return (program_rank & 0xFFFF) << 48 | (texture_rank & 0xFFFFFF) << 24 |
+            (array_rank & 0x7FFFFF) << 1 | (msh.index_type == GL_UNSIGNED_INT ? 1 : 0);
+    }
+
+    void update_draw_list()
+    {
+        if (!draw_list_dirty) {
+            return;
+        }
+        float start_time = glfwGetTime();
+
+        std::unordered_map<GLuint, uint64_t> programs, textures, arrays;
+        draw_list.resize(scene_meshes.size());
+        for (int i = 0; i < scene_meshes.size(); i++) {
+            draw_list[i].key = get_draw_key(scene_meshes[i], programs, textures, arrays);
+            draw_list[i].mesh_index = i;
+        }
+        #ifdef SORT_DRAW_LIST
+            std::stable_sort(draw_list.begin(), draw_list.end());
+        #endif
+        // dense state ranks leave room for a depth term next to the state in the sort key
+        for (int i = 0; i < draw_list.size(); i++) {
+            bool same_state = i > 0 && draw_list[i].key == draw_list[i - 1].key;
+            draw_list[i].state_rank = i == 0 ? 0 : draw_list[i - 1].state_rank + !same_state;
+            draw_list[i].key = (uint64_t) draw_list[i].state_rank << 32;
+        }
+        init_draw_batches();
+        draw_list_dirty = false;
+        sorted_mode = SORT_STATE;
+
+        std::cout << "[INFO] draw list sorted in " << (glfwGetTime() - start_time) * 1000 << " ms: "
+            << programs.size() << " programs, " << textures.size() << " textures, " << arrays.size() << " vertex arrays" << std::endl;
+    }
+
+    // distance from the eye to the nearest visible instance of each mesh, hidden meshes go last
+    void update_mesh_distances(const glm::vec3& eye)
+    {
+        mesh_distances.assign(scene_meshes.size(), FLT_MAX);
+        for (int i = 0; i < scene_meshes.size(); i++) {
+            const mesh& msh = scene_meshes[i];
+            for (int j = msh.first_instance; j < msh.first_instance + msh.instance_count; j++) {
+                if (instance_visible[j]) {
+                    const bounding_volume& bounds = instance_bounds[j];
+                    float distance = std::max(glm::length(bounds.center - eye) - bounds.radius, 0.0f);
+                    mesh_distances[i] = std::min(mesh_distances[i], distance);
+                }
+            }
+        }
+    }
+
+    static uint64_t get_sort_key(uint32_t state_rank, float distance, draw_sort_mode mode)
+    {
+        // the bit pattern of a non-negative float grows with its value
+        uint32_t depth;
+        memcpy(& depth, & distance, sizeof(depth));
+        switch (mode) {
+            case SORT_DEPTH:
+                return (uint64_t) depth << 32 | state_rank;
+            case SORT_STATE_DEPTH:
+                return (uint64_t) state_rank << 32 | depth;
+            default:
+                return (uint64_t) state_rank << 32;
+        }
+    }
+
+    // insertion sort on the previous order, a small camera move leaves few inversions so this stays
+    // close to linear, a large reordering falls back to a full sort after SORT_MOVE_BUDGET moves per item
+    bool sort_draw_items()
+    {
+        size_t moves = 0, budget = draw_list.size() * SORT_MOVE_BUDGET;
+        for (size_t i = 1; i < draw_list.size(); i++) {
+            draw_item item = draw_list[i];
+            size_t j = i;
+            while (j > 0 && item.key < draw_list[j - 1].key) {
+                draw_list[j] = draw_list[j - 1];
+                j--;
+            }
+            draw_list[j] = item;
+            moves += i - j;
+            if (moves > budget) {
+                std::sort(draw_list.begin(), draw_list.end());
+                return true;
+            }
+        }
+        return moves > 0;
+    }
+
+    void sort_draw_list(const glm::vec3& eye, draw_sort_mode mode)
+    {
+        update_draw_list();
+        if (mode == SORT_STATE && sorted_mode == SORT_STATE) {
+            return;
+        }
+        if (mode != SORT_STATE) {
+            update_mesh_distances(eye);
+        }
+        for (int i = 0; i < draw_list.size(); i++) {
+            float distance = mode == SORT_STATE ? 0.0f : mesh_distances[draw_list[i].mesh_index];
+            draw_list[i].key = get_sort_key(draw_list[i].state_rank, distance, mode);
+        }
+        if (sort_draw_items() || mode != sorted_mode) {
+            init_draw_batches();
+        }
+        sorted_mode = mode;
+    }
+
+    void init_draw_batches()
+    {
+        draw_batches.clear();
+        for (int i = 0; i < draw_list.size(); i++) {
+            const mesh& msh = scene_meshes[draw_list[i].mesh_index];
+            bool mergeable = !draw_batches.empty() &&
+                draw_batches.back().VAO == msh.VAO &&
+                draw_batches.back().TEX == msh.TEX &&
+                draw_batches.back().program == msh.program &&
+                draw_batches.back().index_type == msh.index_type;
+
+            if (!mergeable) {
+                draw_batch batch;
+                batch.VAO = msh.VAO;
+                batch.TEX = msh.TEX;
+                batch.program = msh.program;
+                batch.index_type = msh.index_type;
+                draw_batches.push_back(batch);
+            }
+            draw_batches.back().meshes.push_back(draw_list[i].mesh_index);
+        }
+    }
+
+    void init_cull_data()
+    {
+        instance_bounds.resize(scene_instances.size());
+        for (int i = 0; i < scene_instances.size(); i++) {
+            instance_bounds[i] = scene_instances[i].bounds;
+        }
+        instance_spheres.init(instance_bounds);
+        instance_visible.assign(instance_spheres.x.size(), 1);
+
+        #ifdef BVH_CULLING
+            float start_time = glfwGetTime();
+            instance_bvh.build(instance_bounds);
+            std::cout << "[INFO] instance bvh: " << instance_bvh.nodes.size() << " nodes, depth " << instance_bvh.get_depth()
+                << ", built in " << (glfwGetTime() - start_time) * 1000 << " ms" << std::endl;
+        #endif
+    }
+
+    int cull_instances(const glm::mat4& clip)
+    {
+        frustum frs = extract_frustum(clip);
+        #ifdef BVH_CULLING
+            std::fill(instance_visible.begin(), instance_visible.end(), 0);
+            return instance_bvh.cull(frs, instance_bounds, &instance_visible[0]);
+        #else
+            return cull_flat(frs, instance_spheres, instance_bounds, &instance_visible[0]);
+        #endif
+    }
+
+    void get_scene_bounds(glm::vec3& aabb_min, glm::vec3& aabb_max)
+    {
+        aabb_min = glm::vec3(0.f);
+        aabb_max = glm::vec3(0.f);
+        for (int i = 0; i < instance_bounds.size(); i++) {
+            aabb_min = i ? glm::min(aabb_min, instance_bounds[i].aabb_min) : instance_bounds[i].aabb_min;
+            aabb_max = i ? glm::max(aabb_max, instance_bounds[i].aabb_max) : instance_bounds[i].aabb_max;
+        }
+    }
+
+    // picks by instance bounds, the CPU copy of the triangles is released after upload
+    int pick_instance(const glm::vec3& origin, const glm::vec3& direction, float& distance)
+    {
+        if (instance_bvh.nodes.empty()) {
+            instance_bvh.build(instance_bounds);
+        }
+        int hit;
+        instance_bvh.intersect_ray(origin, direction, instance_bounds, hit, distance);
+        return hit;
+    }
+
+    // one array per texture size so every layer keeps its source resolution, fails when a size needs more layers than allowed
+    bool init_texture_arrays(std::unordered_map<GLuint, texture_layer>& layers)
+    {
+        GLint max_layers = 0;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, & max_layers);
+
+        std::unordered_map<uint64_t, int> size_index;
+        std::vector<std::vector<GLuint> > array_textures;
+        std::vector<GLint> array_width, array_height;
+        for (int i = 0; i < scene_meshes.size(); i++) {
+            GLuint TEX = scene_meshes[i].TEX;
+            if (layers.find(TEX) != layers.end()) {
+                continue;
+            }
+            GLint width, height;
+            glBindTexture(GL_TEXTURE_2D, TEX);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, & width);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, & height);
+            uint64_t size_key = (uint64_t) width << 32 | (uint32_t) height;
+            std::unordered_map<uint64_t, int>::iterator found = size_index.insert(std::make_pair(size_key, (int) array_textures.size())).first;
+            if (found->second == array_textures.size()) {
+                array_textures.push_back(std::vector<GLuint>());
+                array_width.push_back(width);
+                array_height.push_back(height);
+            }
+            std::vector<GLuint>& textures = array_textures[found->second];
+            if (textures.size() >= max_layers) {
+                std::cerr << "[WARNING] " << width << "x" << height << " textures exceed " << max_layers << " array layers" << std::endl;
+                return false;
+            }
+            texture_layer entry;
+            entry.array_index = found->second;
+            entry.layer = textures.size();
+            layers[TEX] = entry;
+            textures.push_back(TEX);
+        }
+
+        GLuint read_fbo, draw_fbo;
+        glGenFramebuffers(1, & read_fbo);
+        glGenFramebuffers(1, & draw_fbo);
+        texture_arrays.resize(array_textures.size());
+        for (int a = 0; a < array_textures.size(); a++) {
+            GLint width = array_width[a], height = array_height[a];
+            glGenTextures(1, & texture_arrays[a]);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, texture_arrays[a]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width, height, array_textures[a].size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_fbo);
+            for (int i = 0; i < array_textures[a].size(); i++) {
+                glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, array_textures[a][i], 0);
+                glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture_arrays[a], 0, i);
+                glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            }
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            memory_stats.gpu_texture_bytes += texture::get_texture_bytes(width, height, 4, true) * array_textures[a].size();
+        }
+        glDeleteFramebuffers(1, & read_fbo);
+        glDeleteFramebuffers(1, & draw_fbo);
+        return true;
+    }
+
+    // built on the first switch to indirect drawing, so scenes that never use it pay no texture array memory
+    bool init_indirect_draws()
+    {
+        #ifdef SCENE_BUFFER
+            if (indirect_VAO) {
+                return true;
+            }
+            float start_time = glfwGetTime();
+            std::unordered_map<GLuint, texture_layer> layers;
+            if (!init_texture_arrays(layers)) {
+                return false;
+            }
+            for (int i = 0; i < scene_instances.size(); i++) {
+                instance_records[i].layer = layers[scene_meshes[scene_instances[i].mesh_index].TEX].layer;
+            }
+
+            std::vector<draw_indirect_command> commands;
+            GLenum index_types[2] = {GL_UNSIGNED_SHORT, GL_UNSIGNED_INT};
+            for (int g = 0; g < texture_arrays.size() * 2; g++) {
+                indirect_group group;
+                group.texture_array = texture_arrays[g / 2];
+                group.index_type = index_types[g % 2];
+                group.command_offset = commands.size() * sizeof(draw_indirect_command);
+                for (int i = 0; i < scene_meshes.size(); i++) {
+                    const mesh& msh = scene_meshes[i];
+                    if (msh.index_type != group.index_type || msh.instance_count == 0 || layers[msh.TEX].array_index != g / 2) {
+                        continue;
+                    }
+                    draw_indirect_command command;
+                    command.count = msh.index_size;
+                    command.instance_count = 0;
+                    command.first_index = msh.index_offset / get_index_size(msh.index_type);
+                    command.base_vertex = msh.base_vertex;
+                    command.base_instance = 0;
+                    commands.push_back(command);
+                    indirect_meshes.push_back(i);
+                }
+                group.command_count = commands.size() - group.command_offset / sizeof(draw_indirect_command);
+                if (group.command_count > 0) {
+                    indirect_groups.push_back(group);
+                }
+            }
+
+            glGenVertexArrays(1, & indirect_VAO);
+            glBindVertexArray(indirect_VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, shared_buffer.VBO);
+            set_vertex_attributes();
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, shared_buffer.IBO);
+            glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+            set_instance_attributes();
+            glBindVertexArray(0);
+
+            glGenBuffers(1, & indirect_buffer);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(draw_indirect_command), commands.data(), GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+            memory_stats.gpu_buffer_bytes += commands.size() * sizeof(draw_indirect_command);
+            indirect_commands.swap(commands);
+            update_visible_instances();
+
+            std::cout << "[INFO] indirect draws: " << indirect_groups.size() << " draw calls over " << texture_arrays.size() 
+                << " texture arrays, built in " << (glfwGetTime() - start_time) * 1000 << " ms" << std::endl;
+            memory_stats.report("indirect");
+            return true;
+        #else
+            return false;
+        #endif
+    }
+
+    void report_scene()
+    {
+        std::cout << "[INFO] draw batches: " << scene_meshes.size() << " meshes in "
+            << draw_batches.size() << " batches" << std::endl;
+        std::cout << "[INFO] scene instances: " << scene_instances.size() << " instances of " << scene_meshes.size() << " meshes, "
+            << scene_instances.size() * sizeof(draw_instance) / 1024 << " KB instance data" << std::endl;
+        report_index_buffers();
+        report_vertex_packing();
+        memory_stats.report("scene");
+    }
+
+    void benchmark_import(const aiScene* scn)
+    {
+        std::vector<float> cost(2);
+        int thread_count[2] = {1, import_threads};
+        for (int run = 0; run < 2; run++) {
+            float start_time = glfwGetTime();
+            std::vector<mesh_data> mesh_list = init_scene(scn, thread_count[run]);
+            std::vector<std::string> texture_paths;
+            for (int i = 0; i < mesh_list.size(); i++) {
+                texture_paths.push_back(mesh_list[i].texture_path);
+            }
+            std::vector<image> images = init_images(get_unique_paths(texture_paths), thread_count[run]);
+            cost[run] = glfwGetTime() - start_time;
+
+            for (int i = 0; i < images.size(); i++) {
+                free_image(images[i]);
+            }
+            for (int i = 0; i < mesh_list.size(); i++) {
+                release_mesh_data(mesh_list[i]);
+            }
+        }
+        std::cout << "[INFO] import serial: " << cost[0] * 1000 << " ms, "
+            << import_threads << " threads: " << cost[1] * 1000 << " ms, "
+            << "speedup: " << cost[0] / cost[1] << "x" << std::endl;
+    }
+
+    std::vector<mesh_data> init_scene(const aiScene* scn, int thread_count)
+    {
+        std::vector<mesh_data> mesh_list(scn->mNumMeshes);
+        parallel_for(scn->mNumMeshes, thread_count, [&](int i) {
+            aiMesh* msh = scn->mMeshes[i];
+            init_mesh(scn, msh, mesh_list[i]);
+            mesh_list[i].source_mesh = i;
+        });
+
+        // meshes without triangles (points, lines) never reach the instances or the bvh
+        std::vector<mesh_data> triangle_meshes;
+        triangle_meshes.reserve(mesh_list.size());
+        for (int i = 0; i < mesh_list.size(); i++) {
+            if (mesh_list[i].vertices.empty() || mesh_list[i].indices.empty()) {
+                release_mesh_data(mesh_list[i]);
+                continue;
+            }
+            triangle_meshes.push_back(mesh_data());
+            std::swap(triangle_meshes.back(), mesh_list[i]);
+        }
+        if (triangle_meshes.size() < mesh_list.size()) {
+            std::cout << "[INFO] skipped " << mesh_list.size() - triangle_meshes.size() << " meshes without triangles" << std::endl;
+        }
+        return triangle_meshes;
+    }
+
+    void init_mesh(const aiScene* scn, aiMesh* msh, mesh_data& data)
+    {
+        std::vector<vertex>& vertices = data.vertices;
+        vertices.reserve(msh->mNumVertices);
+        aiVector3D default_uv(0., 0., 0.);
+        aiVector3D default_normal(0., 1., 0.);
+        for (int i = 0; i < msh->mNumVertices; i++) {
+            aiVector3D position = msh->mVertices[i];
+            aiVector3D normal = msh->HasNormals() ? msh->mNormals[i] : default_normal;
+            aiVector3D uv = msh->HasTextureCoords(0) ? msh->mTextureCoords[0][i] : default_uv;
+
+            vertex vtx(
+                glm::vec3(position.x, position.y, position.z),
+                glm::vec2(uv.x, uv.y),
+                glm::vec3(normal.x, normal.y, normal.z)
+            );
+            vertices.push_back(vtx);
+        }
+        data.indices = init_indices(msh);
+        data.texture_path = init_material(scn, msh);
+        data.bounds = compute_bounds(vertices);
+        memory_stats.allocate_cpu(get_mesh_data_bytes(data));
+    }
+
+    static size_t get_mesh_data_bytes(const mesh_data& data)
+    {
+        return data.vertices.capacity() * sizeof(vertex) + data.indices.capacity() * sizeof(unsigned int);
+    }
+
+    void release_mesh_data(mesh_data& data)
+    {
+        memory_stats.release_cpu(get_mesh_data_bytes(data));
+        std::vector<vertex>().swap(data.vertices);
+        std::vector<unsigned int>().swap(data.indices);
+    }
+
+    void weld_scene(std::vector<mesh_data>& mesh_list)
+    {
+        std::vector<size_t> vertex_count(mesh_list.size());
+        parallel_for(mesh_list.size(), import_threads, [&](int i) {
+            mesh_data& data = mesh_list[i];
+            vertex_count[i] = data.vertices.size();
+            memory_stats.release_cpu(get_mesh_data_bytes(data));
+            weld_vertices(data.vertices, data.indices, WELD_EPSILON);
+            memory_stats.allocate_cpu(get_mesh_data_bytes(data));
+        });
+
+        size_t total_before = 0, total_after = 0;
+        for (int i = 0; i < mesh_list.size(); i++) {
+            total_before += vertex_count[i];
+            total_after += mesh_list[i].vertices.size();
+        }
+        std::cout << "[INFO] weld scene: " << mesh_list.size() << " meshes, " << total_before << " -> " << total_after << " vertices, "
+            << (total_before - total_after) * sizeof(vertex) / 1024 << " KB saved" << std::endl;
+    }
+
+    void optimize_scene(std::vector<mesh_data>& mesh_list)
+    {
+        std::vector<float> acmr(mesh_list.size()), atvr(mesh_list.size());
+        parallel_for(mesh_list.size(), import_threads, [&](int i) {
+            mesh_data& data = mesh_list[i];
+            analyze_vertex_cache(data.indices, data.vertices.size(), acmr[i], atvr[i]);
+            optimize_vertex_cache(data.indices, data.vertices.size());
+            optimize_overdraw(data.indices, data.vertices);
+            optimize_vertex_fetch(data.vertices, data.indices);
+            analyze_vertex_cache(data.indices, data.vertices.size(), data.acmr, data.atvr);
+        });
+
+        float acmr_before = 0, acmr_after = 0, atvr_before = 0, atvr_after = 0;
+        for (int i = 0; i < mesh_list.size(); i++) {
+            acmr_before += acmr[i];
+            acmr_after += mesh_list[i].acmr;
+            atvr_before += atvr[i];
+            atvr_after += mesh_list[i].atvr;
+        }
+        if (!mesh_list.empty()) {
+            std::cout << "[INFO] optimize scene: " << mesh_list.size() << " meshes, average ACMR " 
+                << acmr_before / mesh_list.size() << " -> " << acmr_after / mesh_list.size() << ", average ATVR " 
+                << atvr_before / mesh_list.size() << " -> " << atvr_after / mesh_list.size() << std::endl;
+        }
+    }
+
+    void split_scene(std::vector<mesh_data>& mesh_list)
+    {
+        std::vector<mesh_data> split_list;
+        for (int i = 0; i < mesh_list.size(); i++) {
+            mesh_data& data = mesh_list[i];
+            if (data.vertices.size() <= MAX_SHORT_INDEX_VERTICES) {
+                split_list.push_back(mesh_data());
+                std::swap(split_list.back(), data);
+                continue;
+            }
+
+            std::vector<mesh_data> chunks = split_mesh_data(data, MAX_SHORT_INDEX_VERTICES);
+            std::cout << "[INFO] split mesh " << i << ": " << data.vertices.size() << " vertices into "
+                << chunks.size() << " meshes" << std::endl;
+            release_mesh_data(data);
+            for (int j = 0; j < chunks.size(); j++) {
+                memory_stats.allocate_cpu(get_mesh_data_bytes(chunks[j]));
+                chunks[j].bounds = compute_bounds(chunks[j].vertices);
+                split_list.push_back(mesh_data());
+                std::swap(split_list.back(), chunks[j]);
+            }
+        }
+        mesh_list.swap(split_list);
+    }
+
+    void report_vertex_packing()
+    {
+        #ifdef PACKED_VERTEX
+            std::cout << "[INFO] packed vertices: " << packing_stats.vertex_count << " vertices, "
+                << sizeof(vertex) << " -> " << sizeof(packed_vertex) << " bytes each, "
+                << packing_stats.vertex_count * (sizeof(vertex) - sizeof(packed_vertex)) / 1024 << " KB saved" << std::endl;
+            std::cout << "[INFO] packing max error: position " << packing_stats.position
+                << ", texcoord " << packing_stats.texcoord
+                << ", normal " << packing_stats.normal_degrees << " degrees" << std::endl;
+        #endif
+    }
+
+    void report_index_buffers()
+    {
+        size_t short_count = 0, saved_bytes = 0;
+        for (int i = 0; i < scene_meshes.size(); i++) {
+            if (scene_meshes[i].index_type == GL_UNSIGNED_SHORT) {
+                short_count++;
+                saved_bytes += scene_meshes[i].index_size * (sizeof(unsigned int) - sizeof(unsigned short));
+            }
+        }
+        std::cout << "[INFO] 16-bit indices: " << short_count << " of " << scene_meshes.size() << " meshes, "
+            << saved_bytes / 1024 << " KB saved" << std::endl;
+    }
+
+    static uint32_t get_import_flags()
+    {
+        uint32_t flags = 0;
+        #ifdef WELD_VERTICES
+            flags |= IMPORT_FLAG_WELD;
+        #endif
+        #ifdef OPTIMIZE_MESHES
+            flags |= IMPORT_FLAG_OPTIMIZE;
+        #endif
+        #ifdef SHORT_INDICES
+            flags |= IMPORT_FLAG_SHORT_INDICES;
+        #endif
+        return flags;
+    }
+
+    std::vector<unsigned int> init_indices(aiMesh* mesh)
+    {
+        std::vector<unsigned int> indices;
+        indices.reserve(mesh->mNumFaces * 3);
+        for (int i = 0; i < mesh->mNumFaces; i++) {
+            // triangulation passes lines and points through, everything downstream assumes whole triangles
+            aiFace face = mesh->mFaces[i];
+            if (face.mNumIndices != 3) {
+                continue;
+            }
+            for (int j = 0; j < face.mNumIndices; j++) {
+                indices.push_back(face.mIndices[j]);
+            }
+        }
+
+        return indices;
+    }
+
+    std::string init_material(const aiScene* scn, aiMesh* msh)
+    {
+        const aiMaterial* mat = scn->mMaterials[msh->mMaterialIndex];
+        if (mat->GetTextureCount(aiTextureType_DIFFUSE) > 0) {
+            aiString path;
+            mat->GetTexture(aiTextureType_DIFFUSE, 0, &path);
+            return path.data;
+        }
+        return "";
+    }
+
+    std::vector<image> init_images(const std::vector<std::string>& texture_paths, int thread_count)
+    {
+        std::vector<image> images(texture_paths.size());
+        #ifdef LOAD_TEXTURE
+            parallel_for(texture_paths.size(), thread_count, [&](int i) {
+                if (!texture_paths[i].empty()) {
+                    images[i] = decode_image(scene_dir + "/" + texture_paths[i]);
+                }
+            });
+        #endif
+        return images;
+    }
+
+    std::vector<std::string> get_unique_paths(const std::vector<std::string>& texture_paths)
+    {
+        std::vector<std::string> unique_paths;
+        std::unordered_set<std::string> visited;
+        for (int i = 0; i < texture_paths.size(); i++) {
+            const std::string& path = texture_paths[i];
+            if (!path.empty() && !textures.contains(path) && visited.insert(path).second) {
+                unique_paths.push_back(path);
+            }
+        }
+        return unique_paths;
+    }
+
+    std::vector<GLuint> init_textures(const std::vector<std::string>& texture_paths)
+    {
+        std::vector<GLuint> texture_ids(texture_paths.size());
+
+        #ifdef LOAD_TEXTURE
+            std::vector<std::string> unique_paths = get_unique_paths(texture_paths);
+            std::vector<image> images = init_images(unique_paths, import_threads);
+            textures.insert(unique_paths, scene_dir, images);
+        #endif
+
+        for (int i = 0; i < texture_paths.size(); i++) {
+            #ifdef LOAD_TEXTURE
+                if (!texture_paths[i].empty()) {
+                    texture_ids[i] = textures.acquire(texture_paths[i]);
+                    continue;
+                }
+            #endif
+            texture_ids[i] = texture::get_default_texture();
+        }
+
+        #ifdef LOAD_TEXTURE
+            textures.report();
+        #endif
+
+        return texture_ids;
+    }
+
+    // restamp is set when only the mtime changed, so the next launch can skip hashing the source again
+    bool validate_mesh_cache_source(const mesh_cache_header* header, bool& restamp)
+    {
+        uint64_t source_size, source_hash;
+        int64_t source_mtime;
+        restamp = false;
+        if (!get_file_stamp(scene_path.c_str(), source_size, source_mtime)) {
+            return false;
+        }
+        if (header->source_size == source_size && header->source_mtime == source_mtime) {
+            return true;
+        }
+        restamp = hash_file(scene_path.c_str(), source_hash) && header->source_hash == source_hash;
+        return restamp;
+    }
+
+    void update_mesh_cache_stamp(const std::string& cache_path)
+    {
+        uint64_t source_size;
+        int64_t source_mtime;
+        if (!get_file_stamp(scene_path.c_str(), source_size, source_mtime)) {
+            return;
+        }
+        FILE* fp = fopen(cache_path.c_str(), "r+b");
+        if (fp == NULL) {
+            std::cerr << "[WARNING] can not update mesh cache stamp: " << cache_path << std::endl;
+            return;
+        }
+        fseek(fp, offsetof(mesh_cache_header, source_mtime), SEEK_SET);
+        fwrite(& source_mtime, sizeof(source_mtime), 1, fp);
+        fclose(fp);
+    }
+
+    static uint32_t get_max_index(const void* indices, size_t index_count, GLenum index_type)
+    {
+        uint32_t max_index = 0;
+        for (size_t i = 0; i < index_count; i++) {
+            uint32_t index = index_type == GL_UNSIGNED_SHORT ? ((const uint16_t*) indices)[i] : ((const uint32_t*) indices)[i];
+            max_index = std::max(max_index, index);
+        }
+        return max_index;
+    }
+
+    bool load_mesh_cache()
+    {
+        std::string cache_path = scene_path + MESH_CACHE_SUFFIX;
+        mapped_file file;
+        if (!file.open(cache_path.c_str())) {
+            return false;
+        }
+
+        const mesh_cache_header* header = (const mesh_cache_header*) file.data;
+        if (file.size < sizeof(mesh_cache_header) ||
+            memcmp(header->magic, MESH_CACHE_MAGIC, 4) != 0 ||
+            header->version != MESH_CACHE_VERSION ||
+            header->vertex_size != sizeof(vertex) ||
+            header->import_flags != get_import_flags() ||
+            header->weld_epsilon != WELD_EPSILON) {
+            std::cerr << "[WARNING] mesh cache format mismatch, rebuilding: " << cache_path << std::endl;
+            return false;
+        }
+        bool restamp;
+        if (!validate_mesh_cache_source(header, restamp)) {
+            std::cerr << "[WARNING] mesh cache out of date, rebuilding: " << cache_path << std::endl;
+            return false;
+        }
+
+        std::vector<const mesh_cache_entry*> entries;
+        size_t offset = sizeof(mesh_cache_header);
+        for (int i = 0; i < header->mesh_count; i++) {
+            if (offset + sizeof(mesh_cache_entry) > file.size) {
+                break;
+            }
+            const mesh_cache_entry* entry = (const mesh_cache_entry*) (file.data + offset);
+            if (entry->index_type != GL_UNSIGNED_SHORT && entry->index_type != GL_UNSIGNED_INT) {
+                break;
+            }
+            offset += sizeof(mesh_cache_entry)
+                + (size_t) entry->vertex_count * sizeof(vertex)
+                + get_padded_size(entry->index_count * get_index_size(entry->index_type))
+                + get_padded_size(entry->path_length);
+            if (offset > file.size) {
+                break;
+            }
+            entries.push_back(entry);
+        }
+        const mesh_cache_instance* cached_instances = (const mesh_cache_instance*) (file.data + offset);
+        if (entries.size() != header->mesh_count ||
+            offset + (size_t) header->instance_count * sizeof(mesh_cache_instance) > file.size) {
+            std::cerr << "[WARNING] mesh cache truncated, rebuilding: " << cache_path << std::endl;
+            return false;
+        }
+        // indices go to the gpu as they are, one past the vertex range would read outside the vertex buffer
+        for (int i = 0; i < entries.size(); i++) {
+            const mesh_cache_entry* entry = entries[i];
+            const void* indices = (const vertex*) (entry + 1) + entry->vertex_count;
+            if (entry->index_count > 0 && get_max_index(indices, entry->index_count, entry->index_type) >= entry->vertex_count) {
+                std::cerr << "[WARNING] mesh cache corrupted, rebuilding: " << cache_path << std::endl;
+                return false;
+            }
+        }
+        std::vector<mesh_instance> instances(header->instance_count);
+        for (int i = 0; i < instances.size(); i++) {
+            if (cached_instances[i].mesh_index >= entries.size()) {
+                std::cerr << "[WARNING] mesh cache corrupted, rebuilding: " << cache_path << std::endl;
+                return false;
+            }
+            instances[i].mesh_index = cached_instances[i].mesh_index;
+            memcpy(& instances[i].transform[0][0], cached_instances[i].transform, sizeof(cached_instances[i].transform));
+        }
+
+        std::vector<std::string> texture_paths(entries.size());
+        for (int i = 0; i < entries.size(); i++) {
+            const mesh_cache_entry* entry = entries[i];
+            const unsigned char* indices = (const unsigned char*) ((const vertex*) (entry + 1) + entry->vertex_count);
+            const char* path = (const char*) (indices + get_padded_size(entry->index_count * get_index_size(entry->index_type)));
+            texture_paths[i] = std::string(path, entry->path_length);
+        }
+        std::vector<GLuint> texture_ids = init_textures(texture_paths);
+
+        #ifdef SCENE_BUFFER
+            size_t total_vertices = 0, total_index_bytes = 0;
+            for (int i = 0; i < entries.size(); i++) {
+                total_vertices += entries[i]->vertex_count;
+                total_index_bytes += get_padded_size(entries[i]->index_count * get_index_size(entries[i]->index_type));
+            }
+            shared_buffer.create(total_vertices, total_index_bytes);
+        #endif
+
+        for (int i = 0; i < entries.size(); i++) {
+            const mesh_cache_entry* entry = entries[i];
+            const vertex* vertices = (const vertex*) (entry + 1);
+            const void* indices = vertices + entry->vertex_count;
+
+            scene_meshes.push_back(mesh(vertices, entry->vertex_count, indices, entry->index_count, entry->index_type, texture_ids[i], get_scene_buffer()));
+            scene_meshes.back().program = draw_program;
+
+            bounding_volume& bounds = scene_meshes.back().bounds;
+            bounds.aabb_min = glm::vec3(entry->aabb_min[0], entry->aabb_min[1], entry->aabb_min[2]);
+            bounds.aabb_max = glm::vec3(entry->aabb_max[0], entry->aabb_max[1], entry->aabb_max[2]);
+            bounds.center = glm::vec3(entry->center[0], entry->center[1], entry->center[2]);
+            bounds.radius = entry->radius;
+        }
+        set_scene_instances(instances);
+
+        #ifdef OPTIMIZE_MESHES
+            float acmr = 0, atvr = 0;
+            for (int i = 0; i < entries.size(); i++) {
+                acmr += entries[i]->acmr;
+                atvr += entries[i]->atvr;
+            }
+            if (!entries.empty()) {
+                std::cout << "[INFO] cached meshes: average ACMR " << acmr / entries.size()
+                    << ", average ATVR " << atvr / entries.size() << std::endl;
+            }
+        #endif
+
+        // the mapping has to be closed first, windows does not share the file for writing
+        file.close();
+        if (restamp) {
+            update_mesh_cache_stamp(cache_path);
+        }
+        return true;
+    }
+
+    void save_mesh_cache(const std::vector<mesh_data>& mesh_list, const std::vector<mesh_instance>& instances)
+    {
+        mesh_cache_header header;
+        memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+        header.version = MESH_CACHE_VERSION;
+        header.vertex_size = sizeof(vertex);
+        header.mesh_count = mesh_list.size();
+        header.instance_count = instances.size();
+        header.import_flags = get_import_flags();
+        header.weld_epsilon = WELD_EPSILON;
+        if (!get_file_stamp(scene_path.c_str(), header.source_size, header.source_mtime) ||
+            !hash_file(scene_path.c_str(), header.source_hash)) {
+            return;
+        }
+
+        std::string cache_path = scene_path + MESH_CACHE_SUFFIX;
+        FILE* fp = fopen(cache_path.c_str(), "wb");
+        if (fp == NULL) {
+            std::cerr << "[WARNING] can not write mesh cache: " << cache_path << std::endl;
+            return;
+        }
+
+        const char padding[4] = {0, 0, 0, 0};
+        fwrite(& header, sizeof(header), 1, fp);
+        for (int i = 0; i < mesh_list.size(); i++) {
+            const mesh_data& data = mesh_list[i];
+            mesh_cache_entry entry;
+            entry.vertex_count = data.vertices.size();
+            entry.index_count = data.indices.size();
+            entry.path_length = data.texture_path.size();
+            entry.index_type = get_index_type(data.vertices.size());
+            entry.acmr = data.acmr;
+            entry.atvr = data.atvr;
+            for (int j = 0; j < 3; j++) {
+                entry.aabb_min[j] = data.bounds.aabb_min[j];
+                entry.aabb_max[j] = data.bounds.aabb_max[j];
+                entry.center[j] = data.bounds.center[j];
+            }
+            entry.radius = data.bounds.radius;
+
+            fwrite(& entry, sizeof(entry), 1, fp);
+            fwrite(data.vertices.data(), sizeof(vertex), data.vertices.size(), fp);
+            size_t index_bytes = entry.index_count * get_index_size(entry.index_type);
+            if (entry.index_type == GL_UNSIGNED_SHORT) {
+                std::vector<unsigned short> short_indices(data.indices.begin(), data.indices.end());
+                fwrite(short_indices.data(), sizeof(unsigned short), short_indices.size(), fp);
+            }
+            else {
+                fwrite(data.indices.data(), sizeof(unsigned int), data.indices.size(), fp);
+            }
+            fwrite(padding, 1, get_padded_size(index_bytes) - index_bytes, fp);
+            fwrite(data.texture_path.data(), 1, data.texture_path.size(), fp);
+            fwrite(padding, 1, get_padded_size(entry.path_length) - entry.path_length, fp);
+        }
+        for (int i = 0; i < instances.size(); i++) {
+            mesh_cache_instance instance;
+            instance.mesh_index = instances[i].mesh_index;
+            memcpy(instance.transform, glm::value_ptr(instances[i].transform), sizeof(instance.transform));
+            fwrite(& instance, sizeof(instance), 1, fp);
+        }
+
+        if (ferror(fp)) {
+            std::cerr << "[WARNING] can not write mesh cache: " << cache_path << std::endl;
+            fclose(fp);
+            remove(cache_path.c_str());
+            return;
+        }
+        fclose(fp);
+    }
+};
+
+
+scene base_scene;
+
+
+
+// each entry becomes one "#define <entry>" line, e.g. "PACKED_VERTEX" or "CLUSTER_X 16"
+typedef std::vector<std::string> shader_defines;
+
+
+struct uniform_info {
+    GLint location;
+    GLenum type;
+    GLint size;
+};
+
+
+// the binding each block is bound to on the host side, -1 for a block the host does not know
+inline GLint get_block_binding(GLenum block_interface, const std::string& name)
+{
+    static const struct { GLenum block_interface; const char* name; GLint binding; } bindings[] = {
+        { GL_UNIFORM_BLOCK, "FrameData", FRAME_BLOCK_BINDING },
+        { GL_UNIFORM_BLOCK, "LightData", LIGHT_BLOCK_BINDING },
+        { GL_SHADER_STORAGE_BLOCK, "LightList", LIGHT_LIST_BINDING },
+        { GL_SHADER_STORAGE_BLOCK, "ClusterGrid", CLUSTER_GRID_BINDING },
+        { GL_SHADER_STORAGE_BLOCK, "ClusterIndices", CLUSTER_INDEX_BINDING },
+    };
+    for (int i = 0; i < sizeof(bindings) / sizeof(bindings[0]); i++) {
+        if (bindings[i].block_interface == block_interface && name == bindings[i].name) {
+            return bindings[i].binding;
+        }
+    }
+    return -1;
+}
+
+
+template <typename T> GLenum get_uniform_type();
+template <> inline GLenum get_uniform_type<float>() { return GL_FLOAT; }
+template <> inline GLenum get_uniform_type<glm::vec3>() { return GL_FLOAT_VEC3; }
+template <> inline GLenum get_uniform_type<glm::mat4>() { return GL_FLOAT_MAT4; }
+
+inline void upload_uniform(GLint location, float value, GLboolean) { glUniform1f(location, value); }
+inline void upload_uniform(GLint location, const glm::vec3& value, GLboolean) { glUniform3fv(location, 1, glm::value_ptr(value)); }
+inline void upload_uniform(GLint location, const glm::mat4& value, GLboolean transpose) 
+{ 
+    glUniformMatrix4fv(location, 1, transpose, glm::value_ptr(value)); 
+}
+
+
+// resolved once from the reflected uniforms of a program, a missing uniform is reported on the first set
+template <typename T>
+class uniform_handle {
+
+public:
+
+    uniform_handle() : location(-1), name(""), reported(false) {}
+
+    uniform_handle(const std::string& uniform_name, GLint uniform_location) 
+        : location(uniform_location), name(uniform_name), reported(false) {}
+
+    void set(const T& value, GLboolean transpose = GL_FALSE)
+    {
+        if (location < 0) {
+            if (!reported) {
+                std::cerr << "[WARNING] setting uniform that is not active in the program: " << name << std::endl;
+                reported = true;
+            }
+            return;
+        }
+        upload_uniform(location, value, transpose);
+    }
+
+private:
+    GLint location;
+    std::string name;
+    bool reported;
+};
+
+
+class shader {
+
+public:
+
+    GLuint program;
+
+    shader() : program(0), linked(true), source_error(false), vertex_shader(0), fragment_shader(0), program_key(0) {}
+    
+    // compile and link are only submitted here, their status is read when the program is first needed
+    shader(std::string vtx_path, std::string frag_path, const shader_defines& defines = shader_defines()) 
+        : linked(false), source_error(false), vertex_shader(0), fragment_shader(0), program_key(0) {
+        float start_time = glfwGetTime();
         vertex_shader_path = vtx_path;
         fragment_shader_path = frag_path;
+        shader_defs = defines;
         program = glCreateProgram();
 
-        GLuint vertex_shader = create_shader(vertex_shader_path, GL_VERTEX_SHADER);
-        GLuint fragment_shader = create_shader(fragment_shader_path, GL_FRAGMENT_SHADER);
-        glAttachShader(program, vertex_shader);
-        glAttachShader(program, fragment_shader);
-        glLinkProgram(program);
-        glDeleteShader(vertex_shader);
-        glDeleteShader(fragment_shader);
+        std::string preamble = get_preamble(defines);
+        std::string vertex_source, fragment_source;
+        program_count++;
+        // both files are still expanded on failure, so the watcher knows every file the variant depends on
+        bool vertex_read = preprocess(vertex_shader_path, preamble, source_files, vertex_source);
+        bool fragment_read = preprocess(fragment_shader_path, preamble, source_files, fragment_source);
+        if (!vertex_read || !fragment_read) {
+            source_error = true;
+            return;
+        }
+
+        #ifdef PROGRAM_CACHE
+            program_key = get_program_key(vertex_source, fragment_source, preamble);
+            if (load_program_binary(program_key)) {
+                program_cache_hits++;
+                reflect();
+                linked = true;
+                program_submit_time += glfwGetTime() - start_time;
+                return;
+            }
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        #endif
+
+        vertex_shader = create_shader(vertex_source, GL_VERTEX_SHADER);
+        fragment_shader = create_shader(fragment_source, GL_FRAGMENT_SHADER);
+        glAttachShader(program, vertex_shader);
+        glAttachShader(program, fragment_shader);
+        glLinkProgram(program);
+        program_submit_time += glfwGetTime() - start_time;
+    }
+
+    // never blocks with parallel shader compile, without it the driver is asked for the result right away
+    bool is_complete()
+    {
+        if (linked || source_error || !parallel_shader_compile) {
+            return true;
+        }
+        GLint complete = 0;
+        glGetProgramiv(program, GL_COMPLETION_STATUS_ARB, & complete);
+        return complete;
+    }
+
+    bool is_ready()
+    {
+        if (!is_complete()) {
+            return false;
+        }
+        finish();
+        return true;
+    }
+
+    void finish()
+    {
+        if (!try_finish()) {
+            exit(1);
+        }
+    }
+
+    bool try_finish()
+    {
+        if (linked) {
+            return true;
+        }
+        float start_time = glfwGetTime();
+        if (source_error) {
+            std::cerr << "[ERROR] can not read shader sources: " << vertex_shader_path << ", " << fragment_shader_path << std::endl;
+            return false;
+        }
+        if (!validate_program(program)) {
+            if (!validate(vertex_shader, GL_COMPILE_STATUS)) {
+                std::cerr << "[ERROR] can not compile shader: " << vertex_shader_path << std::endl;
+            }
+            if (!validate(fragment_shader, GL_COMPILE_STATUS)) {
+                std::cerr << "[ERROR] can not compile shader: " << fragment_shader_path << std::endl;
+            }
+            std::cerr << "[ERROR] can not link program: " << vertex_shader_path << ", " << fragment_shader_path << std::endl;
+            return false;
+        }
+        release_shaders();
+        reflect();
+
+        #ifdef PROGRAM_CACHE
+            save_program_binary(program_key);
+        #endif
+        linked = true;
+        program_link_time += glfwGetTime() - start_time;
+        return true;
+    }
+
+    // a new program from the current files with the same defines, compiled in the background like the original
+    shader rebuild() const
+    {
+        return shader(vertex_shader_path, fragment_shader_path, shader_defs);
+    }
+
+    void release()
+    {
+        release_shaders();
+        glDeleteProgram(program);
+        program = 0;
+    }
+
+    // a reloaded variant drops the binary of the program it replaces, so edits do not pile up in the cache
+    void remove_program_binary(const shader& replacement) const
+    {
+        #ifdef PROGRAM_CACHE
+            if (program_key != 0 && program_key != replacement.program_key) {
+                remove(get_program_cache_path(program_key).c_str());
+            }
+        #else
+            (void) replacement;
+        #endif
+    }
+
+    bool uses_file(const std::string& path) const { return source_files.count(path) != 0; }
+
+    const std::unordered_set<std::string>& get_source_files() const { return source_files; }
+
+    // a name that is not active or has another type gives a handle that reports itself when set
+    template <typename T>
+    uniform_handle<T> get_uniform(const char* name) const
+    {
+        std::unordered_map<std::string, uniform_info>::const_iterator found = uniforms.find(name);
+        if (found == uniforms.end()) {
+            return uniform_handle<T>(name, -1);
+        }
+        if (found->second.type != get_uniform_type<T>()) {
+            std::cerr << "[WARNING] uniform type mismatch: " << name << " in " << fragment_shader_path << std::endl;
+            return uniform_handle<T>(name, -1);
+        }
+        return uniform_handle<T>(name, found->second.location);
+    }
+
+    void set() 
+    { 
+        finish();
+        glUseProgram(program); 
+    }
+
+    void unset() { glUseProgram(0); }
+
+private:
+
+    std::string vertex_shader_path;
+    std::string fragment_shader_path;
+    shader_defines shader_defs;
+    std::unordered_set<std::string> source_files;
+    std::unordered_map<std::string, uniform_info> uniforms;
+    bool linked;
+    bool source_error;
+    GLuint vertex_shader;
+    GLuint fragment_shader;
+    uint64_t program_key;
+
+    // runs once per link, uniforms inside blocks have no location, blocks are checked against the host bindings
+    void reflect()
+    {
+        uniforms.clear();
+        GLint uniform_count = 0, max_length = 0;
+        glGetProgramInterfaceiv(program, GL_UNIFORM, GL_ACTIVE_RESOURCES, & uniform_count);
+        glGetProgramInterfaceiv(program, GL_UNIFORM, GL_MAX_NAME_LENGTH, & max_length);
+        std::vector<GLchar> name(max_length + 1);
+        for (GLint i = 0; i < uniform_count; i++) {
+            uniform_info info;
+            GLsizei length = 0;
+            glGetActiveUniform(program, i, name.size(), & length, & info.size, & info.type, name.data());
+            const GLenum property = GL_LOCATION;
+            glGetProgramResourceiv(program, GL_UNIFORM, i, 1, & property, 1, NULL, & info.location);
+            if (info.location < 0) {
+                continue;
+            }
+            std::string uniform_name(name.data(), length);
+            if (uniform_name.size() > 3 && uniform_name.compare(uniform_name.size() - 3, 3, "[0]") == 0) {
+                uniform_name.resize(uniform_name.size() - 3);
+            }
+            uniforms[uniform_name] = info;
+        }
+        reflect_blocks(GL_UNIFORM_BLOCK);
+        reflect_blocks(GL_SHADER_STORAGE_BLOCK);
+    }
+
+    // a block the shader binds elsewhere would silently read another buffer
+    void reflect_blocks(GLenum block_interface) const
+    {
+        GLint block_count = 0, max_length = 0;
+        glGetProgramInterfaceiv(program, block_interface, GL_ACTIVE_RESOURCES, & block_count);
+        glGetProgramInterfaceiv(program, block_interface, GL_MAX_NAME_LENGTH, & max_length);
+        std::vector<GLchar> name(max_length + 1);
+        for (GLint i = 0; i < block_count; i++) {
+            GLsizei length = 0;
+            GLint binding = -1;
+            glGetProgramResourceName(program, block_interface, i, name.size(), & length, name.data());
+            const GLenum property = GL_BUFFER_BINDING;
+            glGetProgramResourceiv(program, block_interface, i, 1, & property, 1, NULL, & binding);
+            std::string block_name(name.data(), length);
+            GLint expected = get_block_binding(block_interface, block_name);
+            if (expected < 0) {
+                std::cerr << "[WARNING] block has no host binding: " << block_name << " in " << fragment_shader_path << std::endl;
+            }
+            else if (binding != expected) {
+                std::cerr << "[WARNING] block binding mismatch: " << block_name << " is " << binding 
+                    << ", expected " << expected << " in " << fragment_shader_path << std::endl;
+            }
+        }
+    }
+
+    void release_shaders()
+    {
+        if (vertex_shader) {
+            glDetachShader(program, vertex_shader);
+            glDeleteShader(vertex_shader);
+        }
+        if (fragment_shader) {
+            glDetachShader(program, fragment_shader);
+            glDeleteShader(fragment_shader);
+        }
+        vertex_shader = 0;
+        fragment_shader = 0;
+    }
+
+    inline static bool read_text_file(const char* file_path, std::string& buffer)
+    {
+        FILE* fp = fopen(file_path, "rb");
+        if (fp == NULL) {
+            std::cerr << "[ERROR] can not open shader file: " << file_path << std::endl;
+            return false;
+        }
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        buffer.assign(size > 0 ? size : 0, '\0');
+        bool complete = size >= 0 && fread(& buffer[0], sizeof(GLchar), buffer.size(), fp) == buffer.size();
+        fclose(fp);
+        if (!complete) {
+            std::cerr << "[ERROR] can not read shader file: " << file_path << std::endl;
+        }
+        return complete;
+    }
+
+    static std::string get_preamble(const shader_defines& defines)
+    {
+        std::string preamble;
+        for (int i = 0; i < defines.size(); i++) {
+            preamble += "#define " + defines[i] + "\n";
+        }
+        return preamble;
+    }
+
+    // the preamble has to follow #version, which must stay the first directive of the source
+    static bool preprocess(const std::string& shader_path, const std::string& preamble, std::unordered_set<std::string>& files, std::string& output)
+    {
+        std::unordered_set<std::string> included;
+        std::string source;
+        bool expanded = expand_includes(shader_path, included, source);
+        files.insert(shader_path);
+        files.insert(included.begin(), included.end());
+        if (!expanded) {
+            return false;
+        }
+        size_t version = source.find("#version");
+        size_t insert_at = version == std::string::npos ? 0 : source.find('\n', version);
+        insert_at = insert_at == std::string::npos ? source.size() : insert_at + (version != std::string::npos);
+        output = source.substr(0, insert_at) + preamble + source.substr(insert_at);
+        return true;
+    }
+
+    // #include "file" is resolved against the directory of the including file, every file is included once
+    static bool expand_includes(const std::string& shader_path, std::unordered_set<std::string>& included, std::string& output)
+    {
+        std::string source;
+        if (!read_text_file(shader_path.c_str(), source)) {
+            return false;
+        }
+        std::string shader_dir = shader_path.substr(0, shader_path.find_last_of("/\\") + 1);
+        size_t begin = 0;
+        while (begin < source.size()) {
+            size_t end = source.find('\n', begin);
+            end = end == std::string::npos ? source.size() : end + 1;
+            size_t directive = source.find_first_not_of(" \t", begin);
+            if (directive < end && source.compare(directive, 8, "#include") == 0) {
+                size_t open = source.find('"', directive), close = source.find('"', open + 1);
+                if (open >= end || close >= end) {
+                    std::cerr << "[ERROR] malformed #include in shader file: " << shader_path << std::endl;
+                    return false;
+                }
+                std::string include_path = shader_dir + source.substr(open + 1, close - open - 1);
+                if (included.insert(include_path).second) {
+                    if (!expand_includes(include_path, included, output)) {
+                        return false;
+                    }
+                    if (!output.empty() && output.back() != '\n') {
+                        output += '\n';
+                    }
+                }
+            }
+            else {
+                output.append(source, begin, end - begin);
+            }
+            begin = end;
+        }
+        return true;
+    }
+
+    inline static bool validate(GLuint& object, GLenum type)
+    {
+        GLint status;
+        glGetShaderiv(object, type, &status);
+        if (!status) {
+            GLchar error[1024];
+            glGetShaderInfoLog(object, 1024, NULL, error);
+            std::cerr << "[ERROR] " << error << std::endl;
+            return 0;
+        }
+        else {
+            return 1;
+        }
+    }
+
+    inline static bool validate_program(GLuint object)
+    {
+        GLint status;
+        glGetProgramiv(object, GL_LINK_STATUS, &status);
+        if (!status) {
+            GLchar error[1024];
+            glGetProgramInfoLog(object, 1024, NULL, error);
+            std::cerr << "[ERROR] " << error << std::endl;
+            return 0;
+        }
+        else {
+            return 1;
+        }
+    }
+
+    GLuint create_shader(const std::string& source, GLenum shader_type) 
+    {
+        GLuint shader = glCreateShader(shader_type);
+        const GLchar* code_text = source.c_str();
+        glShaderSource(shader, 1, &code_text, NULL);
+        glCompileShader(shader);
+        return shader;
+    }
+
+    // a binary is only valid for the exact expanded sources and defines on the same driver build
+    static uint64_t get_program_key(const std::string& vertex_source, const std::string& fragment_source, const std::string& preamble)
+    {
+        const char* driver[3] = {
+            (const char*) glGetString(GL_VENDOR), 
+            (const char*) glGetString(GL_RENDERER), 
+            (const char*) glGetString(GL_VERSION)
+        };
+        uint64_t key = fnv1a_hash(vertex_source.data(), vertex_source.size() + 1);
+        key = fnv1a_hash(fragment_source.data(), fragment_source.size() + 1, key);
+        key = fnv1a_hash(preamble.data(), preamble.size() + 1, key);
+        for (int i = 0; i < 3; i++) {
+            key = fnv1a_hash(driver[i], driver[i] ? strlen(driver[i]) + 1 : 0, key);
+        }
+        return key;
+    }
+
+    static std::string get_program_cache_path(uint64_t key)
+    {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+        return std::string(PROGRAM_CACHE_DIR) + name + PROGRAM_CACHE_SUFFIX;
+    }
+
+    bool load_program_binary(uint64_t key)
+    {
+        std::string cache_path = get_program_cache_path(key);
+        FILE* fp = fopen(cache_path.c_str(), "rb");
+        if (fp == NULL) {
+            return false;
+        }
+
+        program_cache_header header;
+        std::vector<char> binary;
+        bool valid = fread(& header, sizeof(header), 1, fp) == 1 &&
+            memcmp(header.magic, PROGRAM_CACHE_MAGIC, 4) == 0 &&
+            header.version == PROGRAM_CACHE_VERSION &&
+            header.program_key == key;
+        if (valid) {
+            binary.resize(header.binary_size);
+            valid = fread(binary.data(), 1, binary.size(), fp) == binary.size();
+        }
+        fclose(fp);
+        if (!valid) {
+            std::cerr << "[WARNING] program cache corrupted, recompiling: " << cache_path << std::endl;
+            return false;
+        }
+
+        glProgramBinary(program, header.binary_format, binary.data(), binary.size());
+        GLint status;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (!status) {
+            std::cerr << "[WARNING] program binary rejected by driver, recompiling: " << cache_path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void save_program_binary(uint64_t key)
+    {
+        GLint format_count = 0, binary_size = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, & format_count);
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, & binary_size);
+        if (format_count == 0 || binary_size == 0) {
+            return;
+        }
+
+        program_cache_header header;
+        memcpy(header.magic, PROGRAM_CACHE_MAGIC, 4);
+        header.version = PROGRAM_CACHE_VERSION;
+        header.program_key = key;
+        std::vector<char> binary(binary_size);
+        GLenum binary_format;
+        GLsizei length = 0;
+        glGetProgramBinary(program, binary_size, & length, & binary_format, binary.data());
+        header.binary_format = binary_format;
+        header.binary_size = length;
+
+        #ifdef _WIN32
+            CreateDirectoryA(PROGRAM_CACHE_DIR, NULL);
+        #else
+            mkdir(PROGRAM_CACHE_DIR, 0755);
+        #endif
+        std::string cache_path = get_program_cache_path(key);
+        FILE* fp = fopen(cache_path.c_str(), "wb");
+        if (fp == NULL) {
+            std::cerr << "[WARNING] can not write program cache: " << cache_path << std::endl;
+            return;
+        }
+        fwrite(& header, sizeof(header), 1, fp);
+        fwrite(binary.data(), 1, length, fp);
+        fclose(fp);
+    }
+};
+
+
+// compiled variants keyed by their shader files and defines, a repeated request returns the same program
+class shader_library {
+
+public:
+
+    shader_library() : submit_time(0), all_ready(true), reload_time(0) {}
+
+    shader& get(const std::string& vtx_path, const std::string& frag_path, const shader_defines& defines)
+    {
+        std::string key = vtx_path + "|" + frag_path;
+        for (int i = 0; i < defines.size(); i++) {
+            key += "|" + defines[i];
+        }
+        std::unordered_map<std::string, shader>::iterator found = variants.find(key);
+        if (found != variants.end()) {
+            return found->second;
+        }
+        if (variants.empty()) {
+            submit_time = glfwGetTime();
+        }
+        all_ready = false;
+        shader& variant = variants.insert(std::make_pair(key, shader(vtx_path, frag_path, defines))).first->second;
+        source_files.insert(variant.get_source_files().begin(), variant.get_source_files().end());
+        #ifndef ASYNC_SHADER_COMPILE
+            variant.finish();
+        #endif
+        return variant;
+    }
+
+    // reports the time spent waiting on link status and, with async compile, the time from the first submit, once
+    bool poll()
+    {
+        if (all_ready) {
+            return true;
+        }
+        for (std::unordered_map<std::string, shader>::iterator it = variants.begin(); it != variants.end(); it++) {
+            if (!it->second.is_ready()) {
+                return false;
+            }
+        }
+        all_ready = true;
+        std::cout << std::endl << "[INFO] " << variants.size() << " shader variants linked, " 
+            << program_link_time * 1000 << " ms waiting on link status, ";
+        #ifdef ASYNC_SHADER_COMPILE
+            std::cout << (glfwGetTime() - submit_time) * 1000 << " ms after submit, ";
+        #endif
+        std::cout << "parallel compile " << (parallel_shader_compile ? "on" : "off") << std::endl;
+        return true;
+    }
+
+    // every variant built from a changed file is rebuilt, the old program keeps drawing until the new one links
+    void reload(const std::vector<std::string>& changed_files)
+    {
+        for (std::unordered_map<std::string, shader>::iterator it = variants.begin(); it != variants.end(); it++) {
+            for (int i = 0; i < changed_files.size(); i++) {
+                if (!it->second.uses_file(changed_files[i])) {
+                    continue;
+                }
+                std::unordered_map<std::string, shader>::iterator stale = pending.find(it->first);
+                if (stale != pending.end()) {
+                    stale->second.release();
+                    pending.erase(stale);
+                }
+                if (pending.empty()) {
+                    reload_time = glfwGetTime();
+                }
+                pending.insert(std::make_pair(it->first, it->second.rebuild()));
+                break;
+            }
+        }
+    }
+
+    // swaps linked rebuilds into their variants between frames and returns the old and new program of each,
+    // so anything holding a raw program handle can follow
+    void swap_reloaded(std::vector<std::pair<GLuint, GLuint> >& swapped)
+    {
+        if (pending.empty()) {
+            return;
+        }
+        for (std::unordered_map<std::string, shader>::iterator it = pending.begin(); it != pending.end();) {
+            if (!it->second.is_complete()) {
+                it++;
+                continue;
+            }
+            shader& variant = variants.find(it->first)->second;
+            if (it->second.try_finish()) {
+                swapped.push_back(std::make_pair(variant.program, it->second.program));
+                glDeleteProgram(variant.program);
+                variant.remove_program_binary(it->second);
+                variant = it->second;
+                source_files.insert(variant.get_source_files().begin(), variant.get_source_files().end());
+            }
+            else {
+                std::cerr << "[WARNING] shader reload failed, the previous program stays in use" << std::endl;
+                it->second.release();
+            }
+            it = pending.erase(it);
+        }
+        if (pending.empty() && !swapped.empty()) {
+            std::cout << std::endl << "[INFO] " << swapped.size() << " shader variants reloaded in " 
+                << (glfwGetTime() - reload_time) * 1000 << " ms" << std::endl;
+        }
+    }
+
+    const std::unordered_set<std::string>& get_source_files() const { return source_files; }
+
+    size_t size() const { return variants.size(); }
+
+private:
+    std::unordered_map<std::string, shader> variants;
+    std::unordered_map<std::string, shader> pending;
+    std::unordered_set<std::string> source_files;
+    float submit_time;
+    bool all_ready;
+    float reload_time;
+};
+
+
+// reports changed shader source files, inotify on linux and a modification time poll elsewhere
+class shader_watcher {
+
+public:
+
+    shader_watcher() : watch_fd(-1), last_poll(0) {}
+
+    void create(const char* dir)
+    {
+        shader_dir = dir;
+        #ifdef __linux__
+            watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (watch_fd >= 0 && inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+                close(watch_fd);
+                watch_fd = -1;
+            }
+            if (watch_fd < 0) {
+                std::cerr << "[WARNING] can not watch shader directory, polling instead: " << dir << std::endl;
+            }
+        #endif
+    }
+
+    // only files some variant was built from are reported, paths are formed like the #include resolution
+    void poll(const std::unordered_set<std::string>& files, std::vector<std::string>& changed)
+    {
+        #ifdef __linux__
+            if (watch_fd >= 0) {
+                alignas(inotify_event) char buffer[4096];
+                ssize_t length;
+                while ((length = read(watch_fd, buffer, sizeof(buffer))) > 0) {
+                    const inotify_event* event;
+                    for (char* ptr = buffer; ptr < buffer + length; ptr += sizeof(inotify_event) + event->len) {
+                        event = (const inotify_event*) ptr;
+                        std::string path = shader_dir + (event->len ? event->name : "");
+                        if (files.count(path) && std::find(changed.begin(), changed.end(), path) == changed.end()) {
+                            changed.push_back(path);
+                        }
+                    }
+                }
+                return;
+            }
+        #endif
+        if (glfwGetTime() - last_poll < SHADER_POLL_INTERVAL) {
+            return;
+        }
+        last_poll = glfwGetTime();
+        for (std::unordered_set<std::string>::const_iterator it = files.begin(); it != files.end(); it++) {
+            struct stat info;
+            if (stat(it->c_str(), & info) != 0) {
+                continue;
+            }
+            std::unordered_map<std::string, time_t>::iterator found = modified_times.find(*it);
+            if (found == modified_times.end()) {
+                modified_times.insert(std::make_pair(*it, info.st_mtime));
+            }
+            else if (found->second != info.st_mtime) {
+                found->second = info.st_mtime;
+                changed.push_back(*it);
+            }
+        }
+    }
+
+private:
+    std::string shader_dir;
+    int watch_fd;
+    float last_poll;
+    std::unordered_map<std::string, time_t> modified_times;
+};
+
+
+shader_library shader_variants;
+shader_watcher source_watcher;
+
+
+void add_define(shader_defines& defines, const char* name, int value)
+{
+    defines.push_back(std::string(name) + " " + std::to_string(value));
+}
+
+
+// bindings are set in the shaders, so a program needs no block or sampler queries before its link finishes
+shader_defines get_shared_defines()
+{
+    shader_defines defines;
+    add_define(defines, "FRAME_BLOCK_BINDING", FRAME_BLOCK_BINDING);
+    add_define(defines, "LIGHT_BLOCK_BINDING", LIGHT_BLOCK_BINDING);
+    add_define(defines, "LIGHT_LIST_BINDING", LIGHT_LIST_BINDING);
+    add_define(defines, "CLUSTER_GRID_BINDING", CLUSTER_GRID_BINDING);
+    add_define(defines, "CLUSTER_INDEX_BINDING", CLUSTER_INDEX_BINDING);
+    add_define(defines, "CLUSTER_X", CLUSTER_X);
+    add_define(defines, "CLUSTER_Y", CLUSTER_Y);
+    add_define(defines, "CLUSTER_Z", CLUSTER_Z);
+    return defines;
+}
+
+
+struct AmbientLight {
+    glm::vec3 color;
+    float intensity;
+
+    AmbientLight() {}
+
+    AmbientLight(glm::vec3 clr, float ist) {
+        color = clr;
+        intensity = ist;
+    }
+};
+
+
+struct ParallelLight {
+    glm::vec3 color;
+    glm::vec3 direction;
+    float intensity;
+
+    ParallelLight() {}
+
+    ParallelLight(glm::vec3 clr, glm::vec3 dir, float ist) {
+        color = clr;
+        direction = dir;
+        intensity = ist;
+    }
+};
+
+
+struct PointLight {
+    glm::vec3 color;
+    glm::vec3 position;
+
+    float constant;
+    float linear;
+    float quadratic;
+    float radius;
+
+    PointLight() {}
+    
+    PointLight(glm::vec3 clr, glm::vec3 pos, float cst, float lin, float quad, float rad) {
+        color = clr;
+        position = pos;
+
+        constant = cst;
+        linear = lin;
+        quadratic = quad;
+        radius = rad;
+    }
+};
+
+
+ParallelLight parallel_light = ParallelLight(
+    glm::vec3(1.0), 
+    glm::vec3(1., -1., 0.), 
+    1.5f
+);
+
+
+std::vector<PointLight> point_lights;
+
+
+PointLight point_light_a = PointLight(
+    glm::vec3(3.0, 4.0, 5.0),
+    glm::vec3(8.0, 25.0, -4.0),
+    0.0,
+    1.0,
+    0.0,
+    AUTHORED_LIGHT_RADIUS
+);
+
+
+PointLight point_light_b = PointLight(
+    glm::vec3(4.0, 4.0, 3.0),
+    glm::vec3(-6.0, 30.0, 3.0),
+    1.0,
+    0.6,
+    0.3,
+    AUTHORED_LIGHT_RADIUS
+);
+
+
+std::vector<PointLight> create_random_lights(int count, glm::vec3 area_min, glm::vec3 area_max, unsigned int seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::vector<PointLight> lights;
+    lights.reserve(count);
+    for (int i = 0; i < count; i++) {
+        glm::vec3 position = area_min + (area_max - area_min) * glm::vec3(unit(random), unit(random), unit(random));
+        glm::vec3 color = glm::vec3(unit(random), unit(random), unit(random));
+        lights.push_back(PointLight(color, position, 1.0, 0.1, 0.05, 5.0f + 10.0f * unit(random)));
+    }
+    return lights;
+}
+
+
+void create_point_lights(glm::vec3 area_min, glm::vec3 area_max)
+{
+    point_lights.clear();
+    point_lights.push_back(point_light_a);
+    point_lights.push_back(point_light_b);
+    // the random light field is for stressing the clustered path, the tutorial scene keeps its two lights
+    #ifdef RANDOM_LIGHTS
+        std::vector<PointLight> extra_lights = create_random_lights(POINT_LIGHT_COUNT - 2, area_min, area_max, 7);
+        point_lights.insert(point_lights.end(), extra_lights.begin(), extra_lights.end());
+    #else
+        (void) area_min;
+        (void) area_max;
+    #endif
+}
+
+
+// std430 light record read by the clustered fragment shaders
+struct cluster_light {
+    glm::vec4 position_radius;
+    glm::vec4 color;
+    glm::vec4 attenuation;
+};
+
+
+// the view frustum is split into CLUSTER_X * CLUSTER_Y screen tiles and CLUSTER_Z exponential depth slices,
+// each cluster gets an (offset, count) range into a flat light index list rebuilt every frame
+class light_clusters {
+
+public:
+    GLuint light_buffer;
+    GLuint grid_buffer;
+    GLuint index_buffer;
+
+    std::vector<uint32_t> grid;
+    std::vector<uint32_t> indices;
+    size_t light_count;
+
+    light_clusters() : light_buffer(0), grid_buffer(0), index_buffer(0), light_count(0) {}
+
+    void create(float fov, float aspect_ratio, float near_plane, float far_plane)
+    {
+        init_cluster_bounds(fov, aspect_ratio, near_plane, far_plane);
+        grid.resize(CLUSTER_X * CLUSTER_Y * CLUSTER_Z * 2);
+        slice_lists.resize(CLUSTER_Z);
+
+        glGenBuffers(1, & light_buffer);
+        glGenBuffers(1, & grid_buffer);
+        glGenBuffers(1, & index_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, grid.size() * sizeof(uint32_t), NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_LIST_BINDING, light_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_GRID_BINDING, grid_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDEX_BINDING, index_buffer);
+        memory_stats.gpu_buffer_bytes += grid.size() * sizeof(uint32_t);
+    }
+
+    void set_lights(const std::vector<PointLight>& lights)
+    {
+        memory_stats.gpu_buffer_bytes -= light_count * sizeof(cluster_light);
+        source_lights = lights;
+        light_count = lights.size();
+        std::vector<cluster_light> records(lights.size());
+        for (int i = 0; i < lights.size(); i++) {
+            records[i].position_radius = glm::vec4(lights[i].position, lights[i].radius);
+            records[i].color = glm::vec4(lights[i].color, 1.0f);
+            records[i].attenuation = glm::vec4(lights[i].constant, lights[i].linear, lights[i].quadratic, 0.0f);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, light_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, records.size() * sizeof(cluster_light), records.data(), GL_STATIC_DRAW);
+        memory_stats.gpu_buffer_bytes += records.size() * sizeof(cluster_light);
+    }
+
+    // view is the transposed view matrix returned by get_look_at_matrix
+    void assign(const glm::mat4& view, int thread_count)
+    {
+        assign_lights(source_lights, view, thread_count);
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_buffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, grid.size() * sizeof(uint32_t), grid.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, index_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(indices.size(), (size_t) 1) * sizeof(uint32_t), indices.data(), GL_STREAM_DRAW);
+    }
+
+    void assign_lights(const std::vector<PointLight>& lights, const glm::mat4& view, int thread_count)
+    {
+        view_lights.resize(lights.size());
+        for (int i = 0; i < lights.size(); i++) {
+            glm::vec4 position(lights[i].position, 1.0f);
+            view_lights[i].center = glm::vec3(glm::dot(view[0], position), glm::dot(view[1], position), glm::dot(view[2], position));
+            view_lights[i].radius = lights[i].radius;
+            get_cluster_range(view_lights[i]);
+        }
+
+        // slices own disjoint clusters, so threads never touch the same list,
+        // a handful of lights is cheaper to assign than to hand to the pool
+        if (view_lights.size() < PARALLEL_LIGHT_COUNT) {
+            thread_count = 1;
+        }
+        parallel_for(CLUSTER_Z, thread_count, [&](int z) {
+            std::vector<std::vector<uint32_t> >& lists = slice_lists[z];
+            lists.resize(CLUSTER_X * CLUSTER_Y);
+            for (int i = 0; i < lists.size(); i++) {
+                lists[i].clear();
+            }
+            for (int i = 0; i < view_lights.size(); i++) {
+                const view_light& light = view_lights[i];
+                if (z < light.range_min[2] || z > light.range_max[2]) {
+                    continue;
+                }
+                for (int y = light.range_min[1]; y <= light.range_max[1]; y++) {
+                    for (int x = light.range_min[0]; x <= light.range_max[0]; x++) {
+                        int cluster = get_cluster_index(x, y, z);
+                        if (sphere_touches_aabb(light.center, light.radius, cluster_min[cluster], cluster_max[cluster])) {
+                            lists[x + y * CLUSTER_X].push_back(i);
+                        }
+                    }
+                }
+            }
+        });
+
+        indices.clear();
+        for (int z = 0; z < CLUSTER_Z; z++) {
+            for (int i = 0; i < CLUSTER_X * CLUSTER_Y; i++) {
+                const std::vector<uint32_t>& list = slice_lists[z][i];
+                int cluster = z * CLUSTER_X * CLUSTER_Y + i;
+                grid[cluster * 2] = indices.size();
+                grid[cluster * 2 + 1] = list.size();
+                indices.insert(indices.end(), list.begin(), list.end());
+            }
+        }
     }
 
-    void set() { glUseProgram(program); }
+    float get_depth_scale() const { return CLUSTER_Z / log(far_depth / near_depth); }
 
-    void unset() { glUseProgram(0); }
+    float get_depth_bias() const { return -CLUSTER_Z * log(near_depth) / log(far_depth / near_depth); }
 
 private:
+    struct view_light {
+        glm::vec3 center;
+        float radius;
+        int range_min[3];
+        int range_max[3];
+    };
 
-    std::string vertex_shader_path;
-    std::string fragment_shader_path;
+    std::vector<PointLight> source_lights;
+    std::vector<view_light> view_lights;
+    std::vector<std::vector<std::vector<uint32_t> > > slice_lists;
+    std::vector<glm::vec3> cluster_min;
+    std::vector<glm::vec3> cluster_max;
+
+    float tile_scale_x;
+    float tile_scale_y;
+    float near_depth;
+    float far_depth;
 
-    inline static GLchar* read_text_file(const char* file_path)
+    static int get_cluster_index(int x, int y, int z) { return x + y * CLUSTER_X + z * CLUSTER_X * CLUSTER_Y; }
+
+    float get_slice_depth(int z) const { return near_depth * pow(far_depth / near_depth, (float) z / CLUSTER_Z); }
+
+    static bool sphere_touches_aabb(const glm::vec3& center, float radius, const glm::vec3& aabb_min, const glm::vec3& aabb_max)
     {
-        FILE* fp = fopen(file_path, "r");
-        assert(fp != NULL);
-        fseek(fp, 0, SEEK_END);
-        int size = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        GLchar* buffer = (GLchar*) malloc(size * sizeof(GLchar));
-        fread(buffer, sizeof(GLchar), size, fp);
-        return buffer;
+        glm::vec3 closest = glm::max(aabb_min, glm::min(center, aabb_max));
+        glm::vec3 offset = closest - center;
+        return glm::dot(offset, offset) <= radius * radius;
     }
 
-    inline static bool validate(GLuint& object, GLenum type)
+    void init_cluster_bounds(float fov, float aspect_ratio, float near_plane, float far_plane)
     {
-        GLint status;
-        glGetShaderiv(object, type, &status);
-        if (!status) {
-            GLchar error[1024];
-            glGetShaderInfoLog(object, 1024, NULL, error);
-            std::cerr << "[ERROR] " << error << std::endl;
-            return 0;
-        }
-        else {
-            return 1;
+        near_depth = near_plane;
+        far_depth = far_plane;
+        tile_scale_y = tan(glm::radians(fov / 2));
+        tile_scale_x = tile_scale_y * aspect_ratio;
+
+        cluster_min.resize(CLUSTER_X * CLUSTER_Y * CLUSTER_Z);
+        cluster_max.resize(CLUSTER_X * CLUSTER_Y * CLUSTER_Z);
+        for (int z = 0; z < CLUSTER_Z; z++) {
+            float depth_min = get_slice_depth(z), depth_max = get_slice_depth(z + 1);
+            for (int y = 0; y < CLUSTER_Y; y++) {
+                for (int x = 0; x < CLUSTER_X; x++) {
+                    float ndc_x[2] = {2.0f * x / CLUSTER_X - 1, 2.0f * (x + 1) / CLUSTER_X - 1};
+                    float ndc_y[2] = {2.0f * y / CLUSTER_Y - 1, 2.0f * (y + 1) / CLUSTER_Y - 1};
+                    float depths[2] = {depth_min, depth_max};
+                    glm::vec3 box_min(1e30f), box_max(-1e30f);
+                    for (int i = 0; i < 8; i++) {
+                        float depth = depths[i >> 2];
+                        glm::vec3 corner(ndc_x[i & 1] * depth * tile_scale_x, ndc_y[(i >> 1) & 1] * depth * tile_scale_y, -depth);
+                        box_min = glm::min(box_min, corner);
+                        box_max = glm::max(box_max, corner);
+                    }
+                    cluster_min[get_cluster_index(x, y, z)] = box_min;
+                    cluster_max[get_cluster_index(x, y, z)] = box_max;
+                }
+            }
         }
     }
 
-    GLuint create_shader(std::string shader_path, GLenum shader_type) 
+    // conservative tile and slice range of a view space sphere, the exact test runs per cluster
+    void get_cluster_range(view_light& light) const
     {
-        GLuint shader = glCreateShader(shader_type);
-        GLchar* code_text = read_text_file(shader_path.c_str());
-        glShaderSource(shader, 1, &code_text, NULL);
-        glCompileShader(shader);
-
-        if (!validate(shader, GL_COMPILE_STATUS)) {
-            exit(1);
+        float depth = -light.center.z;
+        float depth_min = std::max(depth - light.radius, near_depth), depth_max = depth + light.radius;
+        if (depth_max < near_depth || depth_min > far_depth) {
+            light.range_min[2] = 1;
+            light.range_max[2] = 0;
+            return;
         }
-        else {
-            free(code_text);
+        light.range_min[2] = std::max(0, (int) floor(log(depth_min) * get_depth_scale() + get_depth_bias()));
+        light.range_max[2] = std::min(CLUSTER_Z - 1, (int) floor(log(depth_max) * get_depth_scale() + get_depth_bias()));
+
+        light.range_min[0] = 0;
+        light.range_min[1] = 0;
+        light.range_max[0] = CLUSTER_X - 1;
+        light.range_max[1] = CLUSTER_Y - 1;
+        if (depth - light.radius <= near_depth) {
+            return;
+        }
+        float scales[2] = {tile_scale_x, tile_scale_y};
+        int counts[2] = {CLUSTER_X, CLUSTER_Y};
+        for (int axis = 0; axis < 2; axis++) {
+            float low = light.center[axis] - light.radius, high = light.center[axis] + light.radius;
+            float ndc_min = std::min(low / (depth - light.radius), low / (depth + light.radius)) / scales[axis];
+            float ndc_max = std::max(high / (depth - light.radius), high / (depth + light.radius)) / scales[axis];
+            light.range_min[axis] = glm::clamp((int) floor((ndc_min + 1) * 0.5f * counts[axis]), 0, counts[axis] - 1);
+            light.range_max[axis] = glm::clamp((int) floor((ndc_max + 1) * 0.5f * counts[axis]), 0, counts[axis] - 1);
         }
-
-        return shader;
     }
 };
 
 
-struct AmbientLight {
-    glm::vec3 color;
-    float intensity;
+light_clusters clustered_lights;
 
-    AmbientLight() {}
 
-    AmbientLight(glm::vec3 clr, float ist) {
-        color = clr;
-        intensity = ist;
-    }
+// std140 mirrors of the FrameData and LightData blocks, vec3 members are padded to 16 bytes
+struct frame_block {
+    glm::mat4 model;
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec4 camera_pos;
 };
 
 
-struct ParallelLight {
-    glm::vec3 color;
-    glm::vec3 direction;
+struct parallel_light_block {
+    float color[4];
+    float direction[3];
     float intensity;
+};
 
-    ParallelLight() {}
 
-    ParallelLight(glm::vec3 clr, glm::vec3 dir, float ist) {
-        color = clr;
-        direction = dir;
-        intensity = ist;
-    }
+struct light_block {
+    parallel_light_block parallel_light;
+    float cluster_depth[4];
+    int32_t clustering;
+    int32_t point_light_num;
+    float specular;
+    float padding;
 };
 
 
-struct PointLight {
-    glm::vec3 color;
-    glm::vec3 position;
+class uniform_buffer {
 
-    float constant;
-    float linear;
-    float quadratic;
+public:
+    GLuint UBO;
+    GLuint binding;
+    size_t size;
 
-    PointLight() {}
-    
-    PointLight(glm::vec3 clr, glm::vec3 pos, float cst, float lin, float quad) {
-        color = clr;
-        position = pos;
+    uniform_buffer() : UBO(0), binding(0), size(0) {}
 
-        constant = cst;
-        linear = lin;
-        quadratic = quad;
+    void create(GLuint bind_point, size_t buffer_size)
+    {
+        binding = bind_point;
+        size = buffer_size;
+        glGenBuffers(1, & UBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, binding, UBO);
+        memory_stats.gpu_buffer_bytes += size;
+    }
+
+    void update(const void* data)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
     }
 };
 
 
-ParallelLight parallel_light = ParallelLight(
-    glm::vec3(1.0), 
-    glm::vec3(1., -1., 0.), 
-    1.5f
-);
+uniform_buffer frame_uniforms;
+uniform_buffer light_uniforms;
 
 
-PointLight point_light_list[MAX_POINT_LIGHT] = {
-    PointLight(
-        glm::vec3(0.0),
-        glm::vec3(0.0),
-        0.0,
-        0.0,
-        0.0
-    )
-};
+void update_light_block()
+{
+    light_block lights;
+    memset(& lights, 0, sizeof(lights));
+    memcpy(lights.parallel_light.color, glm::value_ptr(parallel_light.color), sizeof(float) * 3);
+    memcpy(lights.parallel_light.direction, glm::value_ptr(parallel_light.direction), sizeof(float) * 3);
+    lights.parallel_light.intensity = parallel_light.intensity;
+
+    lights.clustering = light_clustering;
+    lights.cluster_depth[0] = clustered_lights.get_depth_scale();
+    lights.cluster_depth[1] = clustered_lights.get_depth_bias();
+    lights.cluster_depth[2] = (float) SIZE_WIDTH / CLUSTER_X;
+    lights.cluster_depth[3] = (float) SIZE_HEIGHT / CLUSTER_Y;
+    lights.point_light_num = clustered_lights.light_count;
+    lights.specular = specular;
+    light_uniforms.update(& lights);
+}
 
 
-PointLight point_light_a = PointLight(
-    glm::vec3(3.0, 4.0, 5.0),
-    glm::vec3(8.0, 25.0, -4.0),
-    0.0,
-    1.0,
-    0.0
-);
+// deferred path: the geometry pass fills albedo, normal and depth targets, then one fullscreen pass
+// shades every pixel once with the same clustered light lists as the forward shaders
+class deferred_renderer {
+
+public:
+    GLuint FBO;
+    GLuint albedo_texture;
+    GLuint normal_texture;
+    GLuint depth_texture;
+    GLuint VAO;
 
+    shader* lighting;
+    uniform_handle<glm::mat4> g_inverse_view_projection;
+    GLuint resolved_program;
 
-PointLight point_light_b = PointLight(
-    glm::vec3(4.0, 4.0, 3.0),
-    glm::vec3(-6.0, 30.0, 3.0),
-    1.0,
-    0.6,
-    0.3
-);
+    deferred_renderer() : FBO(0), albedo_texture(0), normal_texture(0), depth_texture(0), VAO(0), lighting(NULL), resolved_program(0) {}
+
+    void create(int width, int height)
+    {
+        albedo_texture = create_target(GL_RGBA8, width, height);
+        normal_texture = create_target(GL_RGB10_A2, width, height);
+        depth_texture = create_target(GL_DEPTH_COMPONENT32F, width, height);
+        memory_stats.gpu_texture_bytes += (size_t) width * height * 12;
+
+        glGenFramebuffers(1, & FBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedo_texture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal_texture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture, 0);
+        GLenum attachments[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers(2, attachments);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "[ERROR] g-buffer framebuffer is incomplete" << std::endl;
+            exit(1);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // the fullscreen triangle is generated from gl_VertexID, core profile still needs a VAO bound
+        glGenVertexArrays(1, & VAO);
+
+        shader_defines defines = get_shared_defines();
+        add_define(defines, "GBUFFER_ALBEDO_UNIT", GBUFFER_ALBEDO_UNIT);
+        add_define(defines, "GBUFFER_NORMAL_UNIT", GBUFFER_NORMAL_UNIT);
+        add_define(defines, "GBUFFER_DEPTH_UNIT", GBUFFER_DEPTH_UNIT);
+        add_define(defines, "INVERSE_VIEW_PROJECTION_LOCATION", INVERSE_VIEW_PROJECTION_LOCATION);
+        lighting = & shader_variants.get(LIGHTING_VERTEX_SHADER, LIGHTING_FRAGMENT_SHADER, defines);
+    }
+
+    void begin()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // view_projection is the transposed product returned by the camera helpers, like the FrameData matrices
+    void shade(const glm::mat4& view_projection)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDisable(GL_DEPTH_TEST);
+        lighting->set();
+        if (lighting->program != resolved_program) {
+            g_inverse_view_projection = lighting->get_uniform<glm::mat4>("g_inverse_view_projection");
+            resolved_program = lighting->program;
+        }
+        g_inverse_view_projection.set(glm::inverse(view_projection), GL_TRUE);
+
+        glActiveTexture(GL_TEXTURE0 + GBUFFER_ALBEDO_UNIT);
+        glBindTexture(GL_TEXTURE_2D, albedo_texture);
+        glActiveTexture(GL_TEXTURE0 + GBUFFER_NORMAL_UNIT);
+        glBindTexture(GL_TEXTURE_2D, normal_texture);
+        glActiveTexture(GL_TEXTURE0 + GBUFFER_DEPTH_UNIT);
+        glBindTexture(GL_TEXTURE_2D, depth_texture);
+
+        glBindVertexArray(VAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+
+        glActiveTexture(GL_TEXTURE0);
+        glEnable(GL_DEPTH_TEST);
+    }
+
+private:
+
+    static GLuint create_target(GLenum format, int width, int height)
+    {
+        GLuint texture;
+        glGenTextures(1, & texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return texture;
+    }
+};
+
+
+deferred_renderer deferred;
 
 
-void create_point_lights()
+void set_active_light_count(int count)
 {
-    point_light_list[0] = point_light_a;
-    point_light_list[1] = point_light_b;
+    active_light_count = std::max(2, std::min(count, (int) point_lights.size()));
+    clustered_lights.set_lights(std::vector<PointLight>(point_lights.begin(), point_lights.begin() + active_light_count));
+    update_light_block();
+    std::cout << std::endl << "[INFO] point lights: " << active_light_count << std::endl;
 }
 
 
@@ -557,6 +4592,109 @@ void mouse_move_callback(GLFWwindow*& window)
 }
 
 
+shader* render_pipelines[RENDER_MODE_COUNT];
+shader* gbuffer_pipelines[RENDER_MODE_COUNT];
+shader* depth_pipelines[RENDER_MODE_COUNT];
+shader* fallback_pipelines[RENDER_MODE_COUNT];
+
+uniform_handle<glm::vec3> g_quant_offset;
+uniform_handle<glm::vec3> g_quant_scale;
+
+
+// every scene variant shares the vertex stage, so the handles of the lit variant also hold for the depth pass
+void resolve_scene_uniforms(const shader& pipeline)
+{
+    #ifdef PACKED_VERTEX
+        if (current_render_mode != RENDER_INDIRECT) {
+            g_quant_offset = pipeline.get_uniform<glm::vec3>("g_quant_offset");
+            g_quant_scale = pipeline.get_uniform<glm::vec3>("g_quant_scale");
+        }
+    #else
+        (void) pipeline;
+    #endif
+}
+
+
+// double buffered, the result of a query is read back one frame later so the cpu never waits on the gpu
+class gpu_query {
+
+public:
+    GLenum target;
+    GLuint queries[2];
+    bool pending[2];
+    int current;
+
+    gpu_query() : target(0), current(0) {}
+
+    void create(GLenum query_target)
+    {
+        target = query_target;
+        glGenQueries(2, queries);
+        pending[0] = pending[1] = false;
+    }
+
+    void begin() { glBeginQuery(target, queries[current]); }
+
+    // returns false while the previous query is still in flight
+    bool end(GLuint64& result)
+    {
+        glEndQuery(target);
+        pending[current] = true;
+        current ^= 1;
+        if (!pending[current]) {
+            return false;
+        }
+        GLint available = 0;
+        glGetQueryObjectiv(queries[current], GL_QUERY_RESULT_AVAILABLE, & available);
+        if (!available) {
+            return false;
+        }
+        glGetQueryObjectui64v(queries[current], GL_QUERY_RESULT, & result);
+        pending[current] = false;
+        return true;
+    }
+};
+
+
+gpu_query prepass_timer;
+gpu_query shade_timer;
+gpu_query sample_counter;
+
+
+void set_render_mode(render_mode mode)
+{
+    if (mode == current_render_mode || !render_pipelines[mode]) {
+        return;
+    }
+    if (mode == RENDER_INDIRECT && !base_scene.init_indirect_draws()) {
+        std::cerr << "[WARNING] indirect drawing unavailable, staying in " << render_mode_names[current_render_mode] << " mode" << std::endl;
+        return;
+    }
+    current_render_mode = mode;
+    std::cout << std::endl << "[INFO] render mode: " << render_mode_names[mode] << std::endl;
+}
+
+
+void set_deferred_shading(bool enabled)
+{
+    if (enabled == deferred_shading || !deferred.FBO) {
+        return;
+    }
+    deferred_shading = enabled;
+    std::cout << std::endl << "[INFO] shading: " << (deferred_shading ? "deferred" : "forward") << std::endl;
+}
+
+
+void set_depth_prepass(bool enabled)
+{
+    if (enabled == depth_prepass || !depth_pipelines[current_render_mode]) {
+        return;
+    }
+    depth_prepass = enabled;
+    std::cout << std::endl << "[INFO] depth pre-pass: " << (depth_prepass ? "on" : "off") << std::endl;
+}
+
+
 void poll_camera_move(GLFWwindow*& window)
 {
     mouse_move_callback(window);
@@ -567,6 +4705,71 @@ void poll_camera_move(GLFWwindow*& window)
         exit(0);
     }
 
+    if (glfwGetKey(window, GLFW_KEY_F1) == GLFW_PRESS) {
+        set_render_mode(RENDER_BATCHED);
+    }
+    if (glfwGetKey(window, GLFW_KEY_F2) == GLFW_PRESS) {
+        set_render_mode(RENDER_INDIRECT);
+    }
+
+    static bool cluster_pressed = false;
+    bool cluster_down = glfwGetKey(window, GLFW_KEY_F3) == GLFW_PRESS;
+    if (cluster_down && !cluster_pressed) {
+        light_clustering = !light_clustering;
+        update_light_block();
+        std::cout << std::endl << "[INFO] light clustering: " << (light_clustering ? "on" : "off") << std::endl;
+    }
+    cluster_pressed = cluster_down;
+
+    static bool deferred_pressed = false;
+    bool deferred_down = glfwGetKey(window, GLFW_KEY_F4) == GLFW_PRESS;
+    if (deferred_down && !deferred_pressed) {
+        set_deferred_shading(!deferred_shading);
+    }
+    deferred_pressed = deferred_down;
+
+    static bool prepass_pressed = false;
+    bool prepass_down = glfwGetKey(window, GLFW_KEY_F5) == GLFW_PRESS;
+    if (prepass_down && !prepass_pressed) {
+        set_depth_prepass(!depth_prepass);
+    }
+    prepass_pressed = prepass_down;
+
+    static bool sort_pressed = false;
+    bool sort_down = glfwGetKey(window, GLFW_KEY_F6) == GLFW_PRESS;
+    if (sort_down && !sort_pressed) {
+        current_sort_mode = (draw_sort_mode) ((current_sort_mode + 1) % SORT_MODE_COUNT);
+        std::cout << std::endl << "[INFO] draw sort: " << sort_mode_names[current_sort_mode] << std::endl;
+    }
+    sort_pressed = sort_down;
+
+    static bool more_lights_pressed = false, fewer_lights_pressed = false;
+    bool more_lights_down = glfwGetKey(window, GLFW_KEY_PAGE_UP) == GLFW_PRESS;
+    bool fewer_lights_down = glfwGetKey(window, GLFW_KEY_PAGE_DOWN) == GLFW_PRESS;
+    if (more_lights_down && !more_lights_pressed) {
+        set_active_light_count(active_light_count * 2);
+    }
+    if (fewer_lights_down && !fewer_lights_pressed) {
+        set_active_light_count(active_light_count / 2);
+    }
+    more_lights_pressed = more_lights_down;
+    fewer_lights_pressed = fewer_lights_down;
+
+    static bool pick_pressed = false;
+    bool pick_down = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    if (pick_down && !pick_pressed) {
+        float distance;
+        int hit = base_scene.pick_instance(cam.pos, cam.target, distance);
+        if (hit >= 0) {
+            std::cout << std::endl << "[INFO] picked instance " << hit << " of mesh " << base_scene.scene_instances[hit].mesh_index
+                << " at distance " << distance << std::endl;
+        }
+        else {
+            std::cout << std::endl << "[INFO] picked nothing" << std::endl;
+        }
+    }
+    pick_pressed = pick_down;
+
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
         cam.pos += MOVE_SPEED * cam.target;
     }
@@ -657,6 +4860,102 @@ glm::mat4 get_look_at_matrix(glm::vec3 camera_pos, glm::vec3 target_pos, glm::ve
 }
 
 
+void benchmark_bvh()
+{
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    glm::mat4 projection = get_projection_matrix(CAMERA_FOV, CAMERA_ASPECT, CAMERA_NEAR, CAMERA_FAR);
+    const int frustum_queries = 64, ray_queries = 100000;
+
+    for (int object_count = 1000; object_count <= 1000000; object_count *= 10) {
+        float world_size = 20 * cbrt((float) object_count);
+        std::vector<bounding_volume> bounds(object_count);
+        for (int i = 0; i < object_count; i++) {
+            glm::vec3 center = glm::vec3(unit(random), unit(random), unit(random)) * world_size;
+            glm::vec3 extent = glm::vec3(unit(random), unit(random), unit(random)) * 4.f + glm::vec3(0.1f);
+            bounds[i].aabb_min = center - extent;
+            bounds[i].aabb_max = center + extent;
+            bounds[i].center = center;
+            bounds[i].radius = glm::length(extent);
+        }
+
+        float start_time = glfwGetTime();
+        bvh tree;
+        tree.build(bounds);
+        float build_time = glfwGetTime() - start_time;
+
+        sphere_list spheres;
+        spheres.init(bounds);
+        std::vector<unsigned char> visible(spheres.x.size());
+        std::vector<glm::mat4> clips(frustum_queries);
+        for (int i = 0; i < frustum_queries; i++) {
+            glm::vec3 eye = glm::vec3(unit(random), unit(random), unit(random)) * world_size;
+            glm::vec3 target = glm::vec3(unit(random), unit(random), unit(random)) * world_size;
+            clips[i] = get_look_at_matrix(eye, target, glm::vec3(0., 1., 0.)) * projection;
+        }
+
+        size_t bvh_visible = 0, flat_visible = 0;
+        start_time = glfwGetTime();
+        for (int i = 0; i < frustum_queries; i++) {
+            std::fill(visible.begin(), visible.end(), 0);
+            bvh_visible += tree.cull(extract_frustum(clips[i]), bounds, &visible[0]);
+        }
+        float bvh_cull_time = glfwGetTime() - start_time;
+
+        start_time = glfwGetTime();
+        for (int i = 0; i < frustum_queries; i++) {
+            flat_visible += cull_flat(extract_frustum(clips[i]), spheres, bounds, &visible[0]);
+        }
+        float flat_cull_time = glfwGetTime() - start_time;
+
+        int ray_hits = 0;
+        start_time = glfwGetTime();
+        for (int i = 0; i < ray_queries; i++) {
+            glm::vec3 origin = glm::vec3(unit(random), unit(random), unit(random)) * world_size;
+            glm::vec3 direction = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) - glm::vec3(0.5f));
+            int hit;
+            float distance;
+            ray_hits += tree.intersect_ray(origin, direction, bounds, hit, distance);
+        }
+        float ray_time = glfwGetTime() - start_time;
+
+        std::cout << "[INFO] bvh benchmark " << object_count << " objects: build " << build_time * 1000 << " ms, "
+            << tree.nodes.size() << " nodes, depth " << tree.get_depth() << std::endl;
+        std::cout << "[INFO]     frustum cull " << bvh_cull_time * 1000 / frustum_queries << " ms (flat "
+            << flat_cull_time * 1000 / frustum_queries << " ms), visible " << bvh_visible / frustum_queries
+            << " (flat " << flat_visible / frustum_queries << ")" << std::endl;
+        std::cout << "[INFO]     rays " << ray_queries / ray_time / 1000000 << " M/s, " << ray_hits << " hits" << std::endl;
+    }
+}
+
+
+void benchmark_light_assignment()
+{
+    glm::mat4 view = get_look_at_matrix(glm::vec3(0.), glm::vec3(0., 0., -1.), glm::vec3(0., 1., 0.));
+    const int runs = 20;
+    int thread_count[2] = {1, get_import_thread_count()};
+    for (int light_count = 64; light_count <= 16384; light_count *= 4) {
+        std::vector<PointLight> lights = create_random_lights(light_count, glm::vec3(-100., -50., -200.), glm::vec3(100., 50., 0.), light_count);
+        float cost[2];
+        for (int run = 0; run < 2; run++) {
+            float start_time = glfwGetTime();
+            for (int i = 0; i < runs; i++) {
+                clustered_lights.assign_lights(lights, view, thread_count[run]);
+            }
+            cost[run] = (glfwGetTime() - start_time) / runs;
+        }
+        size_t max_lights = 0;
+        for (int i = 1; i < clustered_lights.grid.size(); i += 2) {
+            max_lights = std::max(max_lights, (size_t) clustered_lights.grid[i]);
+        }
+        std::cout << "[INFO] light assignment " << light_count << " lights: " << cost[0] * 1000 << " ms with 1 thread, "
+            << cost[1] * 1000 << " ms with " << thread_count[1] << " threads, "
+            << (float) clustered_lights.indices.size() / (CLUSTER_X * CLUSTER_Y * CLUSTER_Z) << " lights per cluster, "
+            << max_lights << " max, " << light_count << " lights per fragment unclustered" << std::endl;
+    }
+}
+
+
 void caculate_fps()
 {
     this_time = glfwGetTime();
@@ -667,9 +4966,131 @@ void caculate_fps()
         time_count += remain_time;
     }
     else {
-        std::cout << "\rFPS: " << frame_count;
+        std::cout << "\rFPS: " << frame_count << ", " << render_mode_names[current_render_mode]
+            << " draw calls: " << draw_call_count
+            << ", state changes: " << state_change_count << " (avoided " << state_change_avoided << ")"
+            << ", visible: " << visible_count << " (culled " << culled_count << ")"
+            << ", cull: " << cull_time * 1000 / frame_count << " ms"
+            << ", sort: " << sort_mode_names[current_sort_mode] << " " << sort_time * 1000 / frame_count << " ms"
+            << ", " << (deferred_shading ? "deferred" : "forward")
+            << ", lights: " << clustered_lights.light_count << (light_clustering ? " clustered" : " unclustered")
+            << ", assign: " << light_assign_time * 1000 / frame_count << " ms"
+            << ", pre-pass: " << (depth_prepass ? "on" : "off") << " " << prepass_gpu_time / frame_count << " ms"
+            << ", shade: " << shade_gpu_time / frame_count << " ms"
+            << " (" << (long long) (shaded_samples / frame_count) << " samples)"
+            << ", submit: " << submit_time * 1000 / frame_count << " ms    " << std::flush;
         frame_count = 0;
         time_count = 0;
+        submit_time = 0;
+        cull_time = 0;
+        sort_time = 0;
+        light_assign_time = 0;
+        prepass_gpu_time = 0;
+        shade_gpu_time = 0;
+        shaded_samples = 0;
+    }
+}
+
+
+// a non-zero program_override replaces the lit program of every batch, used by the depth and g-buffer passes
+int render_batched(GLuint program_override)
+{
+    base_scene.update_draw_list();
+
+    GLuint bound_vao = 0, bound_tex = 0, bound_program = 0;
+    int draw_count = 0;
+
+    glActiveTexture(GL_TEXTURE0);
+    for (int i = 0; i < base_scene.draw_batches.size(); i++) {
+        const draw_batch& batch = base_scene.draw_batches[i];
+        int mesh_count = 0;
+        for (int j = 0; j < batch.meshes.size(); j++) {
+            mesh_count += base_scene.scene_meshes[batch.meshes[j]].visible_count > 0;
+        }
+        if (mesh_count == 0) {
+            continue;
+        }
+
+        int changes = 0;
+        GLuint program = program_override ? program_override : batch.program;
+        if (program != bound_program) {
+            glUseProgram(program);
+            bound_program = program;
+            changes++;
+        }
+        if (batch.VAO != bound_vao) {
+            glBindVertexArray(batch.VAO);
+            bound_vao = batch.VAO;
+            changes++;
+        }
+        if (batch.TEX != bound_tex) {
+            glBindTexture(GL_TEXTURE_2D, batch.TEX);
+            bound_tex = batch.TEX;
+            changes++;
+        }
+        // unsorted per-mesh submission would bind program, VAO and texture for every mesh
+        state_change_count += changes;
+        state_change_avoided += 3 * mesh_count - changes;
+
+        for (int j = 0; j < batch.meshes.size(); j++) {
+            const mesh& msh = base_scene.scene_meshes[batch.meshes[j]];
+            if (msh.visible_count == 0) {
+                continue;
+            }
+            #ifdef PACKED_VERTEX
+                g_quant_offset.set(msh.quant_offset);
+                g_quant_scale.set(msh.quant_scale);
+            #endif
+            glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, msh.index_size, msh.index_type, 
+                (const GLvoid*) msh.index_offset, msh.visible_count, msh.base_vertex, msh.visible_first);
+            draw_count++;
+        }
+    }
+    return draw_count;
+}
+
+
+int render_indirect()
+{
+    glBindVertexArray(base_scene.indirect_VAO);
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, base_scene.indirect_buffer);
+    state_change_count += 2;
+    GLuint bound_array = 0;
+    for (int i = 0; i < base_scene.indirect_groups.size(); i++) {
+        const indirect_group& group = base_scene.indirect_groups[i];
+        if (group.texture_array != bound_array) {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, group.texture_array);
+            bound_array = group.texture_array;
+            state_change_count++;
+        }
+        glMultiDrawElementsIndirect(GL_TRIANGLES, group.index_type, (const GLvoid*) group.command_offset, group.command_count, 0);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    return base_scene.indirect_groups.size();
+}
+
+
+int render_scene(GLuint program_override)
+{
+    if (current_render_mode == RENDER_INDIRECT) {
+        return render_indirect();
+    }
+    return render_batched(program_override);
+}
+
+
+void reload_shaders()
+{
+    std::vector<std::string> changed_files;
+    source_watcher.poll(shader_variants.get_source_files(), changed_files);
+    if (!changed_files.empty()) {
+        shader_variants.reload(changed_files);
+    }
+    std::vector<std::pair<GLuint, GLuint> > swapped;
+    shader_variants.swap_reloaded(swapped);
+    for (int i = 0; i < swapped.size(); i++) {
+        base_scene.replace_program(swapped[i].first, swapped[i].second);
     }
 }
 
@@ -690,86 +5111,136 @@ void render(GLFWwindow*& window)
         0., 0., 0., 1.
     );
     glm::mat4 view = get_look_at_matrix(cam.pos, cam.pos + cam.target, cam.up);
-    glm::mat4 projection = get_projection_matrix(45.0f, 1.78f, 0.1f, 1000.f);
+    glm::mat4 projection = get_projection_matrix(CAMERA_FOV, CAMERA_ASPECT, CAMERA_NEAR, CAMERA_FAR);
+
+    // the block is row_major, matching the transposed upload used before
+    frame_block frame;
+    frame.model = model;
+    frame.view = view;
+    frame.projection = projection;
+    frame.camera_pos = glm::vec4(cam.pos, 1.0f);
+    frame_uniforms.update(& frame);
+
+    float assign_start = glfwGetTime();
+    if (light_clustering) {
+        clustered_lights.assign(view, base_scene.import_threads);
+    }
+    light_assign_time += glfwGetTime() - assign_start;
+
+    #ifdef FRUSTUM_CULLING
+        float cull_start = glfwGetTime();
+        visible_count = base_scene.cull_instances(model * view * projection);
+        culled_count = base_scene.scene_instances.size() - visible_count;
+        base_scene.update_visible_instances();
+        cull_time += glfwGetTime() - cull_start;
+    #else
+        visible_count = base_scene.scene_instances.size();
+        culled_count = 0;
+    #endif
+
+    if (current_render_mode == RENDER_BATCHED) {
+        float sort_start = glfwGetTime();
+        base_scene.sort_draw_list(cam.pos, current_sort_mode);
+        sort_time += glfwGetTime() - sort_start;
+    }
+
+    // variants still compiling are replaced by the fallback program, or their pass is skipped
+    #ifdef SHADER_HOT_RELOAD
+        reload_shaders();
+    #endif
+    shader_variants.poll();
+    bool use_deferred = deferred_shading && gbuffer_pipelines[current_render_mode]->is_ready() && deferred.lighting->is_ready();
+    bool use_prepass = depth_prepass && depth_pipelines[current_render_mode]->is_ready();
+    shader* lit_pipeline = use_deferred ? gbuffer_pipelines[current_render_mode] : render_pipelines[current_render_mode];
+    if (!lit_pipeline->is_ready()) {
+        lit_pipeline = fallback_pipelines[current_render_mode];
+    }
+    static GLuint resolved_program = 0;
+    if (lit_pipeline->program != resolved_program) {
+        resolve_scene_uniforms(* lit_pipeline);
+        resolved_program = lit_pipeline->program;
+    }
 
-    glUniform3f(g_camera_pos, cam.pos.r, cam.pos.g, cam.pos.b);
+    float submit_start = glfwGetTime();
+    draw_call_count = 0;
+    state_change_count = 0;
+    state_change_avoided = 0;
+    GLuint64 query_result;
+    if (use_deferred) {
+        deferred.begin();
+    }
+    if (use_prepass) {
+        prepass_timer.begin();
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        depth_pipelines[current_render_mode]->set();
+        draw_call_count += render_scene(depth_pipelines[current_render_mode]->program);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        // only the nearest fragment of each pixel passes, so every pixel is shaded once
+        glDepthMask(GL_FALSE);
+        glDepthFunc(GL_EQUAL);
+        if (prepass_timer.end(query_result)) {
+            prepass_gpu_time += query_result / 1e6;
+        }
+    }
 
-    glUniformMatrix4fv(g_model, 1, GL_TRUE, glm::value_ptr(model));
-    glUniformMatrix4fv(g_view, 1, GL_TRUE, glm::value_ptr(view));
-    glUniformMatrix4fv(g_projection, 1, GL_TRUE, glm::value_ptr(projection));
+    shade_timer.begin();
+    sample_counter.begin();
+    lit_pipeline->set();
+    draw_call_count += render_scene(lit_pipeline == render_pipelines[current_render_mode] ? 0 : lit_pipeline->program);
+    if (sample_counter.end(query_result)) {
+        shaded_samples += query_result;
+    }
+    if (shade_timer.end(query_result)) {
+        shade_gpu_time += query_result / 1e6;
+    }
 
-    for (int i = 0; i < base_scene.scene_meshes.size(); i++) {
-        glActiveTexture(GL_TEXTURE0);
-        glBindVertexArray(base_scene.scene_meshes[i].VAO);
-        glBindTexture(GL_TEXTURE_2D, base_scene.scene_meshes[i].TEX);
-        glDrawElements(GL_TRIANGLES, base_scene.scene_meshes[i].index_size, GL_UNSIGNED_INT, 0);
+    if (use_prepass) {
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LESS);
+    }
+    if (use_deferred) {
+        deferred.shade(view * projection);
     }
+    submit_time += glfwGetTime() - submit_start;
+
     caculate_fps();
     glfwSwapBuffers(window);
     glfwPollEvents();
 }
 
 
-void create_light_uniform_variable()
-{
-    glUniform3f(g_parallel_light.color, parallel_light.color.r, parallel_light.color.g, parallel_light.color.b);
-    glUniform3f(g_parallel_light.direction, parallel_light.direction.r, parallel_light.direction.g, parallel_light.direction.b);
-    glUniform1f(g_parallel_light.intensity, parallel_light.intensity);
-    glUniform1f(g_specular, specular);
-
-    create_point_lights();
-    glUniform1i(g_point_light_num, MAX_POINT_LIGHT);
-
-    for (int i = 0; i < MAX_POINT_LIGHT; i++) {
-        glUniform3f(g_point_light_list[i].color, point_light_list[i].color.r, point_light_list[i].color.g, point_light_list[i].color.b);
-        glUniform3f(g_point_light_list[i].position, point_light_list[i].position.r, point_light_list[i].position.g, point_light_list[i].position.b);
-        glUniform1f(g_point_light_list[i].constant, point_light_list[i].constant);
-        glUniform1f(g_point_light_list[i].linear, point_light_list[i].linear);
-        glUniform1f(g_point_light_list[i].quadratic, point_light_list[i].quadratic);
-    }
-}
-
-
-void transfer_data(GLuint shader_program)
-{
-    g_model = glGetUniformLocation(shader_program, "g_model");
-    assert(g_model != 0xFFFFFFFF);
-    g_view = glGetUniformLocation(shader_program, "g_view");
-    assert(g_view != 0xFFFFFFFF);
-    g_projection = glGetUniformLocation(shader_program, "g_projection");
-    assert(g_projection != 0xFFFFFFFF);
-    g_sampler = glGetUniformLocation(shader_program, "g_sampler");
-    assert(g_sampler != 0xFFFFFFFF);
-    g_parallel_light.color = glGetUniformLocation(shader_program, "g_parallel_light.color");
-    assert(g_parallel_light.color != 0xFFFFFFFF);
-    g_parallel_light.direction = glGetUniformLocation(shader_program, "g_parallel_light.direction");
-    assert(g_parallel_light.direction != 0xFFFFFFFF);
-    g_parallel_light.intensity = glGetUniformLocation(shader_program, "g_parallel_light.intensity");
-    assert(g_parallel_light.intensity != 0xFFFFFFFF);
-    g_camera_pos = glGetUniformLocation(shader_program, "g_camera_pos");
-    assert(g_camera_pos != 0xFFFFFFFF);
-    g_specular = glGetUniformLocation(shader_program, "g_specular");
-    assert(g_specular != 0xFFFFFFFF);
-    g_point_light_num = glGetUniformLocation(shader_program, "g_point_light_num");
-    assert(g_specular != 0xFFFFFFFF);
-    char buffer[100];
-    for (int i = 0; i < MAX_POINT_LIGHT; i++) {
-        sprintf(buffer, "g_point_light_list[%d].color", i);
-        g_point_light_list[i].color = glGetUniformLocation(shader_program, buffer);
-        assert(g_specular != 0xFFFFFFFF);
-        sprintf(buffer, "g_point_light_list[%d].position", i);
-        g_point_light_list[i].position = glGetUniformLocation(shader_program, buffer);
-        assert(g_specular != 0xFFFFFFFF);
-        sprintf(buffer, "g_point_light_list[%d].constant", i);
-        g_point_light_list[i].constant = glGetUniformLocation(shader_program, buffer);
-        assert(g_specular != 0xFFFFFFFF);
-        sprintf(buffer, "g_point_light_list[%d].linear", i);
-        g_point_light_list[i].linear = glGetUniformLocation(shader_program, buffer);
-        assert(g_specular != 0xFFFFFFFF);
-        sprintf(buffer, "g_point_light_list[%d].quadratic", i);
-        g_point_light_list[i].quadratic = glGetUniformLocation(shader_program, buffer);
-        assert(g_specular != 0xFFFFFFFF);
+shader_defines get_pipeline_defines(render_mode mode)
+{
+    shader_defines defines = get_shared_defines();
+    #ifdef PACKED_VERTEX
+        defines.push_back("PACKED_VERTEX");
+    #endif
+    #ifdef LOAD_TEXTURE
+        defines.push_back("LOAD_TEXTURE");
+    #endif
+    if (mode == RENDER_INDIRECT) {
+        defines.push_back("INDIRECT_DRAW");
     }
+    add_define(defines, "QUANT_OFFSET_LOCATION", QUANT_OFFSET_LOCATION);
+    add_define(defines, "QUANT_SCALE_LOCATION", QUANT_SCALE_LOCATION);
+    add_define(defines, "SAMPLER_LOCATION", SAMPLER_LOCATION);
+    defines.push_back("DEFAULT_ALBEDO " + std::to_string(DEFAULT_TEXTURE_COLOR / 255.0f));
+    return defines;
+}
+
+
+// fallback, lit, g-buffer and depth-only variants of the scene shaders for one render mode
+void init_pipelines(render_mode mode)
+{
+    shader_defines defines = get_pipeline_defines(mode);
+    // the fallback is tiny, it links right away and is drawn until the lit variant is ready
+    fallback_pipelines[mode] = & shader_variants.get(SCENE_VERTEX_SHADER, FALLBACK_FRAGMENT_SHADER, defines);
+    fallback_pipelines[mode]->finish();
+    render_pipelines[mode] = & shader_variants.get(SCENE_VERTEX_SHADER, SCENE_FRAGMENT_SHADER, defines);
+    defines.push_back("GBUFFER_PASS");
+    gbuffer_pipelines[mode] = & shader_variants.get(SCENE_VERTEX_SHADER, SCENE_FRAGMENT_SHADER, defines);
+    defines.back() = "DEPTH_ONLY";
+    depth_pipelines[mode] = & shader_variants.get(SCENE_VERTEX_SHADER, DEPTH_FRAGMENT_SHADER, defines);
 }
 
 
@@ -794,6 +5265,20 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    // glew 2.1 only knows the ARB extension, the KHR one is used when the headers have it
+    #ifdef ASYNC_SHADER_COMPILE
+        if (GLEW_ARB_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+            parallel_shader_compile = true;
+        }
+        #ifdef GL_KHR_parallel_shader_compile
+            else if (GLEW_KHR_parallel_shader_compile) {
+                glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+                parallel_shader_compile = true;
+            }
+        #endif
+    #endif
+
     glfwSwapInterval(0);
 	glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
 	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
@@ -803,14 +5288,43 @@ int main(int argc, char* argv[])
     glEnable(GL_MULTISAMPLE);
     glClearColor(0., 0., 0., 0.);
 
-    shader pipeline = shader(VERTEX_SHADER, FRAGMENT_SHADER);
-    pipeline.set();
-    transfer_data(pipeline.program);
+    frame_uniforms.create(FRAME_BLOCK_BINDING, sizeof(frame_block));
+    light_uniforms.create(LIGHT_BLOCK_BINDING, sizeof(light_block));
+    clustered_lights.create(CAMERA_FOV, CAMERA_ASPECT, CAMERA_NEAR, CAMERA_FAR);
+
+    #ifdef LIGHT_BENCHMARK
+        benchmark_light_assignment();
+    #endif
+
+    deferred.create(SIZE_WIDTH, SIZE_HEIGHT);
+
+    #ifdef SCENE_BUFFER
+        init_pipelines(RENDER_INDIRECT);
+    #endif
+    init_pipelines(RENDER_BATCHED);
+    prepass_timer.create(GL_TIME_ELAPSED);
+    shade_timer.create(GL_TIME_ELAPSED);
+    sample_counter.create(GL_SAMPLES_PASSED);
+
+    current_render_mode = RENDER_BATCHED;
+    #ifdef SHADER_HOT_RELOAD
+        source_watcher.create(SHADER_DIR);
+    #endif
+
+    std::cout << "[INFO] " << shader_variants.size() << " shader variants, " << program_count << " programs submitted in "
+        << program_submit_time * 1000 << " ms, " << program_cache_hits << " from program cache" << std::endl;
+
+    #ifdef BVH_BENCHMARK
+        benchmark_bvh();
+    #endif
 
     const char* scene_path = argv[1];
-    base_scene = scene(scene_path);
+    base_scene = scene(scene_path, render_pipelines[RENDER_BATCHED]->program);
     
-    create_light_uniform_variable();
+    glm::vec3 scene_min, scene_max;
+    base_scene.get_scene_bounds(scene_min, scene_max);
+    create_point_lights(scene_min, scene_max);
+    set_active_light_count(active_light_count);
     glfwSetCursorPos(window, SIZE_WIDTH / 2, SIZE_HEIGHT / 2);
 
     glfwMainLoop(window);
@@ -0,0 +1,28 @@
+#version 430
+
+in vec2 uv_coord;
+
+out vec4 FragColor;
+
+
+layout (binding = GBUFFER_ALBEDO_UNIT) uniform sampler2D g_albedo;
+layout (binding = GBUFFER_NORMAL_UNIT) uniform sampler2D g_normal;
+layout (binding = GBUFFER_DEPTH_UNIT) uniform sampler2D g_depth;
+layout (location = INVERSE_VIEW_PROJECTION_LOCATION) uniform mat4 g_inverse_view_projection;
+
+#include "lighting.glsl"
+
+
+void main()
+{
+    ivec2 coord = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(g_depth, coord, 0).r;
+    if (depth == 1.0) {
+        FragColor = vec4(0.0);
+        return;
+    }
+    vec4 world = g_inverse_view_projection * vec4(uv_coord * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec3 point = world.xyz / world.w;
+    vec3 normal = texelFetch(g_normal, coord, 0).xyz * 2.0 - 1.0;
+    FragColor = texelFetch(g_albedo, coord, 0) * calc_lighting(point, normal);
+}
@@ -0,0 +1,37 @@
+#version 430
+
+in vec2 uv_coord;
+in vec3 normal;
+in vec3 point;
+#ifdef INDIRECT_DRAW
+    flat in float layer;
+#endif
+
+out vec4 FragColor;
+
+#ifdef LOAD_TEXTURE
+    #ifdef INDIRECT_DRAW
+        layout (location = SAMPLER_LOCATION) uniform sampler2DArray g_sampler;
+    #else
+        layout (location = SAMPLER_LOCATION) uniform sampler2D g_sampler;
+    #endif
+#endif
+
+
+vec4 get_albedo()
+{
+    #if !defined(LOAD_TEXTURE)
+        return vec4(vec3(DEFAULT_ALBEDO), 1.0);
+    #elif defined(INDIRECT_DRAW)
+        return texture(g_sampler, vec3(uv_coord, layer));
+    #else
+        return texture(g_sampler, uv_coord);
+    #endif
+}
+
+
+void main()
+{
+    float factor = dot(normalize(normal), vec3(0.0, 1.0, 0.0)) * 0.5 + 0.5;
+    FragColor = vec4(get_albedo().rgb * factor, 1.0);
+}
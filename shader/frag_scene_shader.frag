@@ -0,0 +1,48 @@
+#version 430
+
+in vec2 uv_coord;
+in vec3 normal;
+in vec3 point;
+#ifdef INDIRECT_DRAW
+    flat in float layer;
+#endif
+
+#ifdef GBUFFER_PASS
+    layout (location = 0) out vec4 Albedo;
+    layout (location = 1) out vec4 Normal;
+#else
+    out vec4 FragColor;
+
+    #include "lighting.glsl"
+#endif
+
+#ifdef LOAD_TEXTURE
+    #ifdef INDIRECT_DRAW
+        layout (location = SAMPLER_LOCATION) uniform sampler2DArray g_sampler;
+    #else
+        layout (location = SAMPLER_LOCATION) uniform sampler2D g_sampler;
+    #endif
+#endif
+
+
+vec4 get_albedo()
+{
+    #if !defined(LOAD_TEXTURE)
+        return vec4(vec3(DEFAULT_ALBEDO), 1.0);
+    #elif defined(INDIRECT_DRAW)
+        return texture(g_sampler, vec3(uv_coord, layer));
+    #else
+        return texture(g_sampler, uv_coord);
+    #endif
+}
+
+
+void main()
+{
+    #ifdef GBUFFER_PASS
+        Albedo = get_albedo();
+        Normal = vec4(normalize(normal) * 0.5 + 0.5, 1.0);
+    #else
+        FragColor = get_albedo() * calc_lighting(point, normal);
+    #endif
+}
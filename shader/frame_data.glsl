@@ -0,0 +1,6 @@
+layout (std140, row_major, binding = FRAME_BLOCK_BINDING) uniform FrameData {
+    mat4 g_model;
+    mat4 g_view;
+    mat4 g_projection;
+    vec3 g_camera_pos;
+};
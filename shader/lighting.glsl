@@ -0,0 +1,168 @@
+#include "frame_data.glsl"
+
+struct AmbientLight {
+    vec3 color;
+    float intensity;
+};
+
+struct ParallelLight {
+    vec3 color;
+    vec3 direction;
+    float intensity;
+};
+
+struct PointLight {
+    vec3 color;
+    vec3 position;
+
+    float constant;
+    float linear;
+    float quadratic;
+};
+
+
+layout (std140, binding = LIGHT_BLOCK_BINDING) uniform LightData {
+    ParallelLight g_parallel_light;
+    vec4 g_cluster_depth;
+    int g_clustering;
+    int g_point_light_num;
+    float g_specular;
+};
+
+struct ClusterLight {
+    vec4 position_radius;
+    vec4 color;
+    vec4 attenuation;
+};
+
+layout (std430, binding = LIGHT_LIST_BINDING) readonly buffer LightList {
+    ClusterLight g_lights[];
+};
+
+layout (std430, binding = CLUSTER_GRID_BINDING) readonly buffer ClusterGrid {
+    uvec2 g_clusters[];
+};
+
+layout (std430, binding = CLUSTER_INDEX_BINDING) readonly buffer ClusterIndices {
+    uint g_cluster_lights[];
+};
+
+
+vec4 parallel_diffuse(ParallelLight parallel_light, vec3 nrm)
+{
+    float factor = dot(normalize(nrm), -normalize(parallel_light.direction));
+    if (factor > 0) {
+        return vec4(parallel_light.color, 1.0) * parallel_light.intensity * factor;
+    }
+    else {
+        return vec4(0, 0, 0, 0);
+    }
+}
+
+
+vec4 parallel_specular(ParallelLight parallel_light, vec3 cam_pos, vec3 obj_pos, vec3 nrm)
+{
+    vec3 camera_direction = normalize(cam_pos - obj_pos);
+    vec3 reflection = normalize(reflect(parallel_light.direction, nrm));
+    float factor = dot(camera_direction, reflection);
+    if (factor > 0) {
+        return vec4(parallel_light.color, 1.0) * factor * g_specular;
+    }
+    else {
+        return vec4(0, 0, 0, 0);
+    }
+}
+
+
+vec4 calc_parallel_light(ParallelLight parallel_light, vec3 cam_pos, vec3 obj_pos, vec3 nrm)
+{
+    vec4 diffuse_light, specular_light;
+    diffuse_light = parallel_diffuse(parallel_light, nrm);
+    if (diffuse_light != vec4(0, 0, 0, 0)) {
+        specular_light = parallel_specular(parallel_light, cam_pos, obj_pos, nrm);
+    }
+    else {
+        specular_light = vec4(0, 0, 0, 0);
+    }
+    return diffuse_light + specular_light;
+}
+
+
+vec4 point_diffuse(PointLight point_light, vec3 obj_pos, vec3 nrm)
+{
+    vec3 light_direction = point_light.position - obj_pos;
+    float factor = dot(normalize(nrm), -normalize(light_direction));
+    if (factor > 0) {
+        return vec4(point_light.color, 1.0) * factor;
+    }
+    else {
+        return vec4(0, 0, 0, 0);
+    }
+}
+
+
+vec4 point_specular(PointLight point_light, vec3 cam_pos, vec3 obj_pos, vec3 nrm)
+{
+    vec3 camera_direction = normalize(cam_pos - obj_pos);
+    vec3 light_direction = point_light.position - obj_pos;
+    vec3 reflection = normalize(reflect(light_direction, nrm));
+    float factor = dot(camera_direction, reflection);
+    if (factor > 0) {
+        return vec4(point_light.color, 1.0) * factor * g_specular;
+    }
+    else {
+        return vec4(0, 0, 0, 0);
+    }
+}
+
+vec4 calc_point_light(PointLight point_light, vec3 cam_pos, vec3 obj_pos, vec3 nrm)
+{
+    float light_distance = length(point_light.position - obj_pos);
+    float attenuation = point_light.constant
+     + point_light.linear * light_distance 
+     + point_light.quadratic * pow(light_distance, 2);
+
+    vec4 diffuse = point_diffuse(point_light, obj_pos, nrm);
+    vec4 specular = point_specular(point_light, cam_pos, obj_pos, nrm);
+    return (diffuse + specular) / attenuation;
+}
+
+
+vec4 calc_cluster_light(ClusterLight light, vec3 cam_pos, vec3 obj_pos, vec3 nrm)
+{
+    PointLight point_light = PointLight(light.color.rgb, light.position_radius.xyz, 
+        light.attenuation.x, light.attenuation.y, light.attenuation.z);
+    float falloff = clamp(1.0 - pow(length(point_light.position - obj_pos) / light.position_radius.w, 4), 0.0, 1.0);
+    return calc_point_light(point_light, cam_pos, obj_pos, nrm) * falloff * falloff;
+}
+
+
+// CLUSTER_X, CLUSTER_Y and CLUSTER_Z come from the define preamble
+uint get_cluster_index(vec3 obj_pos)
+{
+    float depth = -(g_view * vec4(obj_pos, 1.0)).z;
+    uint slice = uint(clamp(floor(log(depth) * g_cluster_depth.x + g_cluster_depth.y), 0.0, float(CLUSTER_Z - 1)));
+    uvec2 tile = uvec2(min(gl_FragCoord.xy / g_cluster_depth.zw, vec2(CLUSTER_X - 1, CLUSTER_Y - 1)));
+    return tile.x + tile.y * CLUSTER_X + slice * (CLUSTER_X * CLUSTER_Y);
+}
+
+
+vec4 calc_lighting(vec3 obj_pos, vec3 nrm)
+{
+    vec4 ambient_light, parallel_light, point_light;
+    ambient_light = vec4(0.1, 0.1, 0.1, 1.0);
+    parallel_light = calc_parallel_light(g_parallel_light, g_camera_pos, obj_pos, nrm);
+    point_light = vec4(0.0);
+    if (g_clustering != 0) {
+        uvec2 cluster = g_clusters[get_cluster_index(obj_pos)];
+        for (uint i = 0; i < cluster.y; i++) {
+            point_light += calc_cluster_light(g_lights[g_cluster_lights[cluster.x + i]], g_camera_pos, obj_pos, nrm);
+        }
+    }
+    else {
+        for (int i = 0; i < g_point_light_num; i++) {
+            point_light += calc_cluster_light(g_lights[i], g_camera_pos, obj_pos, nrm);
+        }
+    }
+    return ambient_light + parallel_light + point_light;
+}
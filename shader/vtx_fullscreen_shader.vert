@@ -0,0 +1,10 @@
+#version 430
+
+out vec2 uv_coord;
+
+
+void main()
+{
+    uv_coord = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(uv_coord * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,78 @@
+#version 430
+
+layout (location = 0) in vec3 Position;
+layout (location = 1) in vec2 TexCoord;
+#ifdef PACKED_VERTEX
+    layout (location = 2) in vec2 Normal;
+#else
+    layout (location = 2) in vec3 Normal;
+#endif
+#ifdef INDIRECT_DRAW
+    layout (location = 3) in float Layer;
+#endif
+#if defined(PACKED_VERTEX) && defined(INDIRECT_DRAW)
+    layout (location = 4) in vec3 QuantOffset;
+    layout (location = 5) in vec3 QuantScale;
+#endif
+layout (location = 6) in mat4 Instance;
+
+#include "frame_data.glsl"
+
+#if defined(PACKED_VERTEX) && !defined(INDIRECT_DRAW)
+    layout (location = QUANT_OFFSET_LOCATION) uniform vec3 g_quant_offset;
+    layout (location = QUANT_SCALE_LOCATION) uniform vec3 g_quant_scale;
+#endif
+
+#ifndef DEPTH_ONLY
+    out vec2 uv_coord;
+    out vec3 normal;
+    out vec3 point;
+    #ifdef INDIRECT_DRAW
+        flat out float layer;
+    #endif
+#endif
+
+// the depth pre-pass and the lit pass must produce bit identical depth for GL_EQUAL
+invariant gl_Position;
+
+
+vec3 decode_octahedral(vec2 oct)
+{
+    vec3 nrm = vec3(oct, 1.0 - abs(oct.x) - abs(oct.y));
+    float t = max(-nrm.z, 0.0);
+    nrm.x += nrm.x >= 0.0 ? -t : t;
+    nrm.y += nrm.y >= 0.0 ? -t : t;
+    return normalize(nrm);
+}
+
+
+vec3 get_position()
+{
+    #if defined(PACKED_VERTEX) && defined(INDIRECT_DRAW)
+        return QuantOffset + Position * QuantScale;
+    #elif defined(PACKED_VERTEX)
+        return g_quant_offset + Position * g_quant_scale;
+    #else
+        return Position;
+    #endif
+}
+
+
+void main()
+{
+    mat4 world_matrix = g_model * Instance;
+    vec4 world = world_matrix * vec4(get_position(), 1.0);
+    gl_Position = g_projection * g_view * world;
+    #ifndef DEPTH_ONLY
+        uv_coord = TexCoord;
+        #ifdef PACKED_VERTEX
+            normal = (world_matrix * vec4(decode_octahedral(Normal), 0.0)).xyz;
+        #else
+            normal = (world_matrix * vec4(Normal, 0.0)).xyz;
+        #endif
+        point = world.xyz;
+        #ifdef INDIRECT_DRAW
+            layer = Layer;
+        #endif
+    #endif
+}